@@ -0,0 +1,133 @@
+// Receive path benchmark
+//
+// Frames and splits the fields of two workloads, a burst of small
+// Msg frames and a few very large ones, with each ivyScanDelimiters
+// routine and with the contains and split path it replaced in
+// IvyClient::onSocketReadyRead and IvyMessage.
+
+#include "ivytokenizer.h"
+
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+#include <QElapsedTimer>
+
+#include <stdio.h>
+
+static const int smallFrames = 200000;
+static const int largeFrames = 4;
+static const int largeFields = 8;
+static const int largeFieldSize = 1024 * 1024;
+
+// "2 <id><STX>ground<ETX>42.<n><ETX><EOL>"
+static QByteArray smallBurst()
+{
+    QByteArray buffer;
+    for (int i = 0; i < smallFrames; i++) {
+        buffer.append("2 ");
+        buffer.append(QByteArray::number(i % 64));
+        buffer.append('\x02');
+        buffer.append("ground\x03" "42.");
+        buffer.append(QByteArray::number(i));
+        buffer.append("\x03\n");
+    }
+    return buffer;
+}
+
+// Frames of largeFields fields of largeFieldSize bytes
+static QByteArray largeMessages()
+{
+    QByteArray field(largeFieldSize, 'x');
+    QByteArray buffer;
+    for (int i = 0; i < largeFrames; i++) {
+        buffer.append("2 1\x02");
+        for (int j = 0; j < largeFields; j++) {
+            buffer.append(field);
+            buffer.append('\x03');
+        }
+        buffer.append('\n');
+    }
+    return buffer;
+}
+
+// As IvyClient::onSocketReadyRead and IvyMessage before the scan
+static int splitPath(const QByteArray &buffer)
+{
+    int fields = 0;
+    if (!buffer.contains("\n")) return fields;
+
+    QList<QByteArray> frames = buffer.split('\n');
+    for (int i = 0; i < frames.count(); i++) {
+        const QByteArray &frame = frames.at(i);
+        if (!frame.size()) continue;
+        int stxPos = frame.indexOf(2);
+        QList<QByteArray> parameters = frame.mid(stxPos + 1).split(0x03);
+        parameters.removeLast();
+        fields += parameters.count();
+    }
+    return fields;
+}
+
+// As IvyClient::onSocketReadyRead and IvyMessage::parse
+static int scanPath(const QByteArray &buffer, QVector<int> *delimiters)
+{
+    delimiters->clear();
+    ivyScanDelimiters(buffer.constData(), buffer.size(), delimiters);
+
+    const char *data = buffer.constData();
+    int fields = 0;
+    int frameStart = 0;
+    int start = 0;
+    for (int i = 0; i < delimiters->count(); i++) {
+        int position = delimiters->at(i);
+        if (data[position] == '\n') {
+            QByteArray frame(data + frameStart, position - frameStart);
+            frameStart = position + 1;
+        } else if (data[position] == 0x03) {
+            QByteArray field(data + start, position - start);
+            fields++;
+        }
+        start = position + 1;
+    }
+    return fields;
+}
+
+static void report(const char *name, qint64 nanoseconds, int repeats, int size, int fields)
+{
+    double msecs = nanoseconds / 1e6 / repeats;
+    printf("  %-8s %9.3f ms %9.1f MB/s  %d fields\n", name, msecs, size / msecs / 1e3, fields);
+}
+
+static void run(const char *workload, const QByteArray &buffer, int repeats)
+{
+    static const char *routines[] = { "scalar", "sse2", "avx2" };
+
+    printf("%s, %d bytes, %d passes\n", workload, buffer.size(), repeats);
+
+    QElapsedTimer timer;
+    int fields = 0;
+
+    timer.start();
+    for (int i = 0; i < repeats; i++) fields = splitPath(buffer);
+    report("split", timer.nsecsElapsed(), repeats, buffer.size(), fields);
+
+    QVector<int> delimiters;
+    for (unsigned int r = 0; r < sizeof(routines) / sizeof(routines[0]); r++) {
+        if (!ivySetTokenizer(routines[r])) {
+            printf("  %-8s unavailable\n", routines[r]);
+            continue;
+        }
+
+        timer.start();
+        for (int i = 0; i < repeats; i++) fields = scanPath(buffer, &delimiters);
+        report(routines[r], timer.nsecsElapsed(), repeats, buffer.size(), fields);
+    }
+}
+
+int main()
+{
+    run("Small message burst", smallBurst(), 20);
+    run("Large messages", largeMessages(), 10);
+
+    return 0;
+}
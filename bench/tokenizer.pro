@@ -0,0 +1,15 @@
+# Receive path benchmark, see tokenizer.cpp
+# qmake tokenizer.pro && make && ./tokenizer
+
+TEMPLATE = app
+TARGET = tokenizer
+CONFIG += console release
+CONFIG -= app_bundle
+QT -= gui
+
+INCLUDEPATH += ..
+
+SOURCES += tokenizer.cpp \
+    ../ivytokenizer.cpp
+
+HEADERS += ../ivytokenizer.h
@@ -3,9 +3,19 @@ QT       += network
 SOURCES += ivy-qt/subscription.cpp \
     ivy-qt/ivyqt.cpp \
     ivy-qt/ivyclient.cpp \
-    ivy-qt/ivymessage.cpp
+    ivy-qt/ivymessage.cpp \
+    ivy-qt/ivyrecorder.cpp \
+    ivy-qt/ivyreplay.cpp \
+    ivy-qt/ivylatency.cpp \
+    ivy-qt/ivytokenizer.cpp \
+    ivy-qt/ivysubscriptiontable.cpp
 
 HEADERS += ivy-qt/ivyqt.h \
     ivy-qt/ivyclient.h \
 ivy-qt/subscription.h \
-    ivy-qt/ivymessage.h
+    ivy-qt/ivymessage.h \
+    ivy-qt/ivyrecorder.h \
+    ivy-qt/ivyreplay.h \
+    ivy-qt/ivylatency.h \
+    ivy-qt/ivytokenizer.h \
+    ivy-qt/ivysubscriptiontable.h
@@ -1,4 +1,7 @@
 #include "ivyclient.h"
+#include "ivytokenizer.h"
+
+#include <string.h>
 
 // This will be a client that has announced over UDP
 IvyClient::IvyClient(IvyQt *ivyQt, QHostAddress *host, quint16 *port, QString *name, QByteArray *appId, QObject *parent) :
@@ -9,7 +12,7 @@ IvyClient::IvyClient(IvyQt *ivyQt, QHostAddress *host, quint16 *port, QString *n
     socket = NULL; // could need this
 
     // Initialize Members
-    this->hostAddress = host;
+    this->hostAddress = new QHostAddress(*host);
     this->port = *port;
     this->name = *name;
     if (appId != 0) this->appId = *appId;
@@ -21,9 +24,11 @@ IvyClient::IvyClient(IvyQt *ivyQt, QHostAddress *host, quint16 *port, QString *n
     connect(socket, SIGNAL(bytesWritten(qint64)),
             this, SLOT(onSocketBytesWritten(qint64)));
 
-    socket->connectToHost(*hostAddress,this->port);
-
     init();
+
+    outgoing = true;
+
+    socket->connectToHost(*hostAddress,this->port);
 }
 
 // Ivy Client Initialized witha *QTcpSocket
@@ -58,6 +63,22 @@ void IvyClient::init()
     pingId = 0;
     receivedByeRequest = false;
 
+    outgoing = false;
+    peerIdReceived = false;
+    subscriptionsSent = false;
+    duplicate = false;
+    member = false;
+    cached = false;
+    endRegexpPending = false;
+    subscriptionPeer = -1;
+    pendingSubscriptionCount = 0;
+    subscriptionCount = 0;
+    subscriptionBytes = 0;
+    peerId = 0;
+
+    timeToReady = -1;
+    handshakeElapsedTimer.start();
+
     connect(&pingTimeoutTimer, SIGNAL(timeout()),
             this, SLOT(onPingTimeoutTimerTimeout()));
 
@@ -66,10 +87,28 @@ void IvyClient::init()
     statsUdpBytesIn = 0;
     statsUdpBytesOut = 0;
 
-//    messageCountStatsIn[10];
-//    messageCountStatsOut[10];
+    memset(messageCountStatsIn, 0, sizeof(messageCountStatsIn));
+    memset(messageCountStatsOut, 0, sizeof(messageCountStatsOut));
     messageCountTotalIn = 0;
     messageCountTotalOut = 0;
+    statsConflatedFrames = 0;
+    statsBulkQueuedFrames = 0;
+    statsExpiredFrames = 0;
+    transport = DefaultTransport;
+    transportProfile = IvyQt::transportProfile(transport);
+    bulkLaneBytes = 0;
+    bulkLaneOffset = 0;
+    rcvScanned = 0;
+
+    limits = IvyQt::unlimited();
+    closing = false;
+    discardingFrame = false;
+    outboundLimited = false;
+    statsRetainedMessageBytes = 0;
+    statsLimitBreaches = 0;
+    statsOversizedFrames = 0;
+    statsRejectedSubscriptions = 0;
+    statsDroppedFrames = 0;
 }
 
 
@@ -78,8 +117,8 @@ void IvyClient::onSocketStateChanged(QAbstractSocket::SocketState state)
 {
     // TCP Connected
     if (state == QAbstractSocket::ConnectedState) {
-        sendPeerId();
-        sendSubscriptions();
+        applyTransport();
+        sendHandshake();
         emit ivyQt->logMessage(QString("TCP CONNECT TO %1:%2").arg(socket->peerAddress().toString()).arg(QString::number(socket->peerPort())),1);
     }
 
@@ -88,6 +127,12 @@ void IvyClient::onSocketStateChanged(QAbstractSocket::SocketState state)
 
         ready = false;
 
+        // Stale cache entry, the peer was never there
+        if (cached) {
+            ivyQt->forgetCachedPeer(this);
+            return;
+        }
+
         emit ivyQt->logMessage(QString("Client %1 disconnected!").arg(name),1);
 
         // Was this expected? Do we have a previous Bye?
@@ -98,47 +143,430 @@ void IvyClient::onSocketStateChanged(QAbstractSocket::SocketState state)
 
 }
 
+// Frames are located and split from a single scan of the receive
+// buffer. A frame without its EOL yet is kept for the next read.
 void IvyClient::onSocketReadyRead()
 {
-    // TODO: Take into account packet fragmentation
-    rcvBuffer.clear();
+    if (closing) return;
+
+    qint64 readTime = ivyQt->latencyTracing ? ivyTraceNow() : 0;
+
+    // Read in place, the buffer grows geometrically
+    // At most maxReceiveBuffer bytes are held, the rest is left in the
+    // socket whose buffer is as large, so TCP flow control paces the peer
+    qint64 available = socket->bytesAvailable();
+    if (limits.maxReceiveBuffer) available = qBound((qint64)0, (qint64)limits.maxReceiveBuffer - rcvBuffer.size(), available);
+    int size = rcvBuffer.size();
+    rcvBuffer.resize(size + available);
+    qint64 read = socket->read(rcvBuffer.data() + size, available);
+    rcvBuffer.resize(size + qMax(read, (qint64)0));
 
     // Log TCP Bytes Sent In
-    logTrafficStats(TCP,In,socket->bytesAvailable());
-
-    rcvBuffer.append(socket->readAll());
-
-    // Proceed if EOM delimiter located
-    if (rcvBuffer.contains("\n")) {
-        QList<QByteArray> dat = this->rcvBuffer.split('\n');
-        for(int i = 0; i < dat.count(); i++) {
-            QByteArray *data = new QByteArray(dat.at(i));
-            if (data->size()) {
-                IvyMessage *msg = new IvyMessage(data,this);
-                processMessage(msg);
+    logTrafficStats(TCP,In,qMax(read, (qint64)0));
+
+    // Rest of a frame dropped for its size
+    if (discardingFrame) {
+        int eol = rcvBuffer.indexOf('\n');
+        if (eol < 0) {
+            rcvBuffer.clear();
+            readRemaining();
+            return;
+        }
+        rcvBuffer.remove(0, eol + 1);
+        rcvDelimiters.clear();
+        rcvScanned = 0;
+        discardingFrame = false;
+    }
+
+    // Only bytes added since the last read are scanned
+    int scanned = rcvDelimiters.count();
+    ivyScanDelimiters(rcvBuffer.constData() + rcvScanned, rcvBuffer.size() - rcvScanned, &rcvDelimiters);
+    for (int i = scanned; i < rcvDelimiters.count(); i++)
+        rcvDelimiters[i] += rcvScanned;
+    rcvScanned = rcvBuffer.size();
+
+    int frameStart = 0;
+    int firstDelimiter = 0;
+    for (int i = 0; i < rcvDelimiters.count() && !duplicate && !closing; i++) {
+        int eol = rcvDelimiters.at(i);
+        if (rcvBuffer.at(eol) != '\n') continue;
+
+        if (limits.maxFrameSize && eol - frameStart > limits.maxFrameSize) {
+            if (limitExceeded(FrameSizeLimit, eol - frameStart)) return;
+            statsOversizedFrames++;
+        } else if (eol > frameStart) {
+            QByteArray *data = new QByteArray(rcvBuffer.constData() + frameStart, eol - frameStart);
+            if (ivyQt->recorder)
+                ivyQt->recorder->recordFrame(peerId, *data);
+            qint64 framedTime = readTime ? ivyTraceNow() : 0;
+            IvyMessage *msg = new IvyMessage(data,rcvDelimiters.constData() + firstDelimiter,i - firstDelimiter,frameStart,this);
+            if (readTime) {
+                msg->trace[TraceRead] = readTime;
+                msg->trace[TraceFramed] = framedTime;
+                msg->trace[TraceParsed] = ivyTraceNow();
             }
+            processMessage(msg);
         }
+
+        frameStart = eol + 1;
+        firstDelimiter = i + 1;
+    }
+
+    if (closing) return;
+
+    // Incomplete frame already over the limit is not waited for,
+    // nor one filling the receive buffer as it could never complete
+    int incomplete = rcvBuffer.size() - frameStart;
+    if ((limits.maxFrameSize && incomplete > limits.maxFrameSize) ||
+        (limits.maxReceiveBuffer && incomplete >= limits.maxReceiveBuffer)) {
+        if (limitExceeded(FrameSizeLimit, incomplete)) return;
+        statsOversizedFrames++;
+        discardingFrame = true;
+        frameStart = rcvBuffer.size();
+        firstDelimiter = rcvDelimiters.count();
+    }
+
+    // Delimiters of the incomplete frame are kept, rebased
+    if (frameStart) {
+        rcvBuffer.remove(0, frameStart);
+        rcvDelimiters.remove(0, firstDelimiter);
+        for (int i = 0; i < rcvDelimiters.count(); i++)
+            rcvDelimiters[i] -= frameStart;
+        rcvScanned -= frameStart;
     }
 
+    readRemaining();
+
+    if (!ivyQt->batchWindow) ivyQt->flushBatches();
+
+}
+
+// Bytes left in the socket by maxReceiveBuffer raise no readyRead
+// until more arrive, they are read from the event loop instead
+void IvyClient::readRemaining()
+{
+    if (!closing && socket->bytesAvailable())
+        QMetaObject::invokeMethod(this, "onSocketReadyRead", Qt::QueuedConnection);
+}
+
+void IvyClient::setTransport(IvyTransport transport)
+{
+    this->transport = transport;
+    transportProfile = IvyQt::transportProfile(transport);
+
+    if (socket->state() == QAbstractSocket::ConnectedState) applyTransport();
+}
+
+// Buffer sizes are only set when the profile asks for them, so
+// returning to the default profile leaves them as they were
+void IvyClient::applyTransport()
+{
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, transportProfile.lowDelay ? 1 : 0);
+    socket->setSocketOption(QAbstractSocket::KeepAliveOption, transportProfile.keepAlive ? 1 : 0);
+    if (transportProfile.sendBufferSize)
+        socket->setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, transportProfile.sendBufferSize);
+    if (transportProfile.receiveBufferSize)
+        socket->setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, transportProfile.receiveBufferSize);
+
+    // A higher threshold may leave room for waiting bulk frames
+    if (!bulkLane.isEmpty()) flushBulkLane();
+}
+
+// The socket stops reading from the network once it holds
+// maxReceiveBuffer bytes, and onSocketReadyRead keeps no more than
+// that in rcvBuffer, leaving TCP flow control to pace the peer
+void IvyClient::setLimits(const IvyPeerLimits &limits)
+{
+    this->limits = limits;
+    socket->setReadBufferSize(limits.maxReceiveBuffer);
+    if (!limits.maxOutboundBytes) outboundLimited = false;
+}
+
+// Return TRUE if the connection is being closed for it
+// Closed from the event loop, the breach may be found while
+// IvyQt is iterating its clients or subscriptions
+bool IvyClient::limitExceeded(IvyPeerLimit limit, qint64 value)
+{
+    statsLimitBreaches++;
+
+    emit ivyQt->logMessage(QString("%1 exceeded %2 limit with %3%4")
+                           .arg(name)
+                           .arg(IvyQt::limitName(limit))
+                           .arg(QString::number(value))
+                           .arg(limits.disconnect ? ", disconnecting" : ""),1);
+    emit ivyQt->ivyPeerLimitExceeded(this, limit, value);
+
+    if (!limits.disconnect) return false;
+
+    closing = true;
+    QTimer::singleShot(0, this, SLOT(abortConnection()));
+
+    return true;
+}
+
+void IvyClient::abortConnection()
+{
+    socket->abort();
+}
+
+// Refused bindings are answered with an Error for the identifier
+void IvyClient::rejectSubscription(quint16 identifier, IvyPeerLimit limit, qint64 value)
+{
+    if (limitExceeded(limit, value)) return;
+
+    statsRejectedSubscriptions++;
+
+    QByteArray text = QString("%1 limit exceeded").arg(IvyQt::limitName(limit)).toUtf8();
+    sendMessage(Error,identifier,&text);
+}
+
+static qint64 retainedBytes(IvyMessage *msg)
+{
+    return sizeof(IvyMessage) + 2 * msg->data->size();
+}
+
+// Received messages stay valid for bus users holding them until
+// maxRetainedBytes is exceeded, the oldest are then released down to
+// half of it. Pending batches are delivered first, as they may point
+// to them. Release goes through deleteLater on the bus thread, queued
+// deliveries to slots in other threads are not waited for, so those
+// messages are only valid on the bus thread. Return TRUE if the
+// connection is being closed for it
+bool IvyClient::retainMessage(IvyMessage *msg)
+{
+    messages.append(msg);
+    statsRetainedMessageBytes += retainedBytes(msg);
+
+    if (!limits.maxRetainedBytes || statsRetainedMessageBytes <= limits.maxRetainedBytes) return false;
+    if (limitExceeded(RetainedBytesLimit, statsRetainedMessageBytes)) return true;
+
+    ivyQt->flushBatches();
+    while (messages.count() > 1 && statsRetainedMessageBytes > limits.maxRetainedBytes / 2) {
+        IvyMessage *released = messages.takeFirst();
+        statsRetainedMessageBytes -= retainedBytes(released);
+        released->deleteLater();
+    }
+
+    return false;
+}
+
+qint64 IvyClient::memoryUsage()
+{
+    qint64 bytes = rcvBuffer.capacity() + rcvDelimiters.capacity() * sizeof(int);
+    bytes += socket->bytesAvailable() + socket->bytesToWrite();
+    bytes += bulkLaneBytes + controlBacklog.capacity() + encodeBuffer.capacity();
+    bytes += (qint64)subscriptionCount * IvySubscriptionTable::bytesPerRow + subscriptionBytes;
+    bytes += statsRetainedMessageBytes;
+
+    return bytes;
+}
+
+qint64 IvyClient::congestionThreshold()
+{
+    if (transportProfile.congestionThreshold) return transportProfile.congestionThreshold;
+    return ivyQt->congestionThreshold;
 }
 
 void IvyClient::onSocketBytesWritten(qint64 bytes)
 {
+    if (!bulkLane.isEmpty()) flushBulkLane();
 
+    if (outboundLimited && outboundBytes() <= limits.maxOutboundBytes / 2) outboundLimited = false;
+}
+
+// Hold a bulk frame while the socket is congested or earlier bulk
+// frames are still waiting, otherwise write it immediately as
+// header then payload, so a shared payload is never copied into
+// a per peer frame. A conflated frame replaces any held one.
+int IvyClient::sendBulkFrame(MsgType type, quint16 identifier, const QByteArray &header, const QByteArray &payload, bool conflate, qint64 deadline)
+{
+    if (!socket->isValid() || closing) return true;
+
+    if (ivyQt->isLogging(1)) {
+        QString message = QString("LOCAL -> %1:%2 %3%4")
+                .arg(socket->peerAddress().toString())
+                .arg(QString::number(socket->peerPort()))
+                .arg(QString(header))
+                .arg(QString(payload.left(qMin(payload.size() - 1, maxLoggedPayload))))
+                .append(payload.size() - 1 > maxLoggedPayload ? "...<EOL>" : "<EOL>");
+        ivyQt->logMessage(&message,1);
+    }
+
+    if (conflate && conflatedFrames.contains(identifier)) {
+        IvyOutboundFrame &held = conflatedFrames[identifier];
+        bulkLaneBytes += payload.size() - held.payload.size();
+        held.payload = payload;
+        held.deadline = deadline;
+        statsConflatedFrames++;
+        return false;
+    }
+
+    // Breached once, then dropped until half drained
+    qint64 size = header.size() + payload.size();
+    if (limits.maxOutboundBytes && (outboundLimited || outboundBytes() + size > limits.maxOutboundBytes)) {
+        if (!outboundLimited) {
+            outboundLimited = true;
+            if (limitExceeded(OutboundBytesLimit, outboundBytes() + size)) return true;
+        }
+        statsDroppedFrames++;
+        return true;
+    }
+
+    // Large frames are always streamed from the lane
+    if (bulkLane.isEmpty() && size <= writeChunkSize && socket->bytesToWrite() < congestionThreshold()) {
+        if (writeBulk(header.constData(), header.size()) || writeBulk(payload.constData(), payload.size())) return true;
+        logMessageStats(type,Out);
+        return false;
+    }
+
+    IvyOutboundFrame outbound;
+    outbound.type = type;
+    outbound.identifier = identifier;
+    outbound.conflated = conflate;
+    outbound.deadline = deadline;
+    outbound.header = header;
+    outbound.payload = payload;
+    if (conflate) {
+        conflatedFrames.insert(identifier, outbound);
+        outbound.payload.clear();
+    }
+
+    bulkLane.append(outbound);
+    bulkLaneBytes += header.size() + payload.size();
+    statsBulkQueuedFrames++;
+
+    if (bulkLane.count() == 1) flushBulkLane();
+
+    return false;
+}
+
+// Write waiting bulk frames in order for as long as the socket
+// stays below the congestion threshold, discarding frames whose
+// deadline has passed while they waited. Frames are written in
+// chunks of at most writeChunkSize, so a large payload shared by
+// many peers is never copied whole into each of their sockets.
+void IvyClient::flushBulkLane()
+{
+    qint64 now = 0;
+
+    while (!bulkLane.isEmpty() && socket->bytesToWrite() < congestionThreshold()) {
+        IvyOutboundFrame &outbound = bulkLane.first();
+
+        if (!bulkLaneOffset) {
+            // Conflated frame may have been dropped by a DelRegexp
+            if (outbound.conflated) {
+                if (!conflatedFrames.contains(outbound.identifier)) {
+                    bulkLane.removeFirst();
+                    continue;
+                }
+                outbound = conflatedFrames.take(outbound.identifier);
+                outbound.conflated = false;
+            }
+
+            if (outbound.deadline) {
+                if (!now) now = ivyTraceNow();
+                if (now >= outbound.deadline) {
+                    bulkLaneBytes -= outbound.header.size() + outbound.payload.size();
+                    bulkLane.removeFirst();
+                    statsExpiredFrames++;
+                    continue;
+                }
+            }
+        }
+
+        if (writeChunk(outbound)) break;
+        if (bulkLaneOffset) continue;
+
+        logMessageStats(outbound.type,Out);
+        bulkLane.removeFirst();
+        writeControlBacklog();
+    }
+}
+
+// Write the next chunk of the frame at the head of the lane,
+// bulkLaneOffset returns to 0 once the frame is complete
+int IvyClient::writeChunk(const IvyOutboundFrame &outbound)
+{
+    qint64 headerSize = outbound.header.size();
+    qint64 frameSize = headerSize + outbound.payload.size();
+
+    const char *data;
+    qint64 length;
+    if (bulkLaneOffset < headerSize) {
+        data = outbound.header.constData() + bulkLaneOffset;
+        length = headerSize - bulkLaneOffset;
+    } else {
+        data = outbound.payload.constData() + (bulkLaneOffset - headerSize);
+        length = qMin(frameSize - bulkLaneOffset, (qint64)writeChunkSize);
+    }
+
+    if (writeBulk(data, length)) return true;
+
+    bulkLaneOffset += length;
+    bulkLaneBytes -= length;
+    if (bulkLaneOffset == frameSize) bulkLaneOffset = 0;
+
+    return false;
+}
+
+// Write the rest of a partly written frame regardless of
+// congestion, before the connection is closed
+void IvyClient::completePartialFrame()
+{
+    while (bulkLaneOffset)
+        if (writeChunk(bulkLane.first())) return;
+
+    logMessageStats(bulkLane.first().type,Out);
+    bulkLane.removeFirst();
+    writeControlBacklog();
+}
+
+// Control frames held while a bulk frame was partly written
+void IvyClient::writeControlBacklog()
+{
+    if (controlBacklog.isEmpty()) return;
+
+    QByteArray frames = controlBacklog;
+    controlBacklog.clear();
+    writeFrames(frames);
+}
+
+// Identifier no longer names the pattern a held conflated frame
+// was matched for, after a DelRegexp or a replacing AddRegexp
+void IvyClient::discardHeldFrame(quint16 identifier)
+{
+    if (conflatedFrames.contains(identifier)) {
+        IvyOutboundFrame held = conflatedFrames.take(identifier);
+        bulkLaneBytes -= held.header.size() + held.payload.size();
+    }
+    msgHeaders.remove(identifier);
+}
+
+// On DelRegexp, or when a replacing AddRegexp is refused
+void IvyClient::removeSubscription(quint16 identifier)
+{
+    bool removed = ivyQt->removeRemoteSubscription(this, identifier);
+    discardHeldFrame(identifier);
+    if (removed) {
+        if (member) ivyQt->removeRelayTarget(this, identifier);
+        emit ivyClientSubscriptionDeleted(this,identifier);
+    }
 }
 
 void IvyClient::processMessage(IvyMessage *msg)
 {
     if (!msg->isValid()) return; // abort if message is invalid
 
-    this->messages.append(msg);
+    if (retainMessage(msg)) return;
 
-    QString message = QString("LOCAL <- %1:%2: %3")
-            .arg(socket->peerAddress().toString())
-            .arg(QString::number(socket->peerPort()))
-            .arg(QString(*msg->data))
-            .append("<EOL>");
-    emit ivyQt->logMessage(&message,1);
+    if (ivyQt->isLogging(1)) {
+        QString message = QString("LOCAL <- %1:%2: %3")
+                .arg(socket->peerAddress().toString())
+                .arg(QString::number(socket->peerPort()))
+                .arg(QString(*msg->data))
+                .append("<EOL>");
+        emit ivyQt->logMessage(&message,1);
+    }
 
     // Log Message Statistics
     logMessageStats(msg->type,In);
@@ -147,37 +575,75 @@ void IvyClient::processMessage(IvyMessage *msg)
     if (msg->type == Bye) processBye();
 
     // Message Type 1: Subscription
-    if (msg->type == AddRegexp) {
-        Subscription *s = subscriptionByIdentifier(msg->identifier);
-        if (s && msg->subscription) {
-            // modify existing subscription
-            s->setPattern(msg->subscription->pattern());
-            // emit signal if this is a post-ready subscription
-            if (ready) emit ivyClientSubscription(this,s,true);
-        }
+    // A known identifier replaces the previous subscription
+    // Bindings over the peer's limits are refused
+    if (msg->type == AddRegexp && msg->parameters.count()) {
+        int length = msg->parameters.at(0).size();
+        bool known = ivyQt->remoteSubscriptions.find(subscriptionPeer, msg->identifier) >= 0;
+        if (limits.maxPatternLength && length > limits.maxPatternLength) {
+            // The refused pattern was meant to replace a known one,
+            // which the peer no longer expects to match
+            if (known) removeSubscription(msg->identifier);
+            rejectSubscription(msg->identifier, PatternLengthLimit, length);
+        } else if (limits.maxSubscriptions && !known && subscriptionCount >= limits.maxSubscriptions)
+            rejectSubscription(msg->identifier, SubscriptionLimit, subscriptionCount + 1);
         else {
-            // append subscription to list
-            subscriptions.append(msg->subscription);
+            QString pattern = QString(msg->parameters.at(0));
+            bool replaced = ivyQt->addRemoteSubscription(this, msg->identifier, pattern);
+            if (replaced) discardHeldFrame(msg->identifier);
+            if (member) {
+                if (replaced) ivyQt->removeRelayTarget(this, msg->identifier);
+                ivyQt->addRelayTarget(this, msg->identifier, pattern);
+            }
             // emit signal if this is a post-ready subscription
-            if (ready) emit ivyClientSubscription(this,s,false);
+            if (ready) emit ivyClientSubscription(this,msg->identifier,pattern,replaced);
         }
     }
 
+    // Message Type 4: Subscription Deletion
+    if (msg->type == DelRegexp) removeSubscription(msg->identifier);
+
     // Message Type 2: Text Message
+    // Delivered to IvyQt by direct call, the signal is
+    // for outside observers only
     if (msg->type == Msg) {
         emit ivyMessageReceived(msg);
+        ivyQt->on_ivyMessageReceived(msg);
+    }
+
+    // Message Type 7: Direct Message
+    if (msg->type == DirectMsg) {
+        emit ivyDirectMessageReceived(msg);
+        ivyQt->on_ivyDirectMessageReceived(msg);
     }
 
     // End of Initial Subscriptions
     // An agent is not considered ready until
     // it is deemed all of the subscriptions have
     // been relayed
-    if (msg->type == EndRegexp)
-        setReady();
+    // Waits for subscriptions still being compiled
+    if (msg->type == EndRegexp) {
+        if (!pendingSubscriptionCount) setReady();
+        else endRegexpPending = true;
+    }
 
     // Peer ID Message
-    if (msg->type == StartRegexp)
+    // Identifier carries the peer's listening TCP port, which lets
+    // incoming connections be matched against announced peers
+    if (msg->type == StartRegexp) {
+        if (cached && !ivyQt->confirmCachedPeer(this, msg->getPeerName(), msg->identifier)) return;
+
         this->name = msg->getPeerName();
+        this->port = msg->identifier;
+        peerIdReceived = true;
+
+        if (ivyQt->transportFor(name) != transport) setTransport(ivyQt->transportFor(name));
+        setLimits(ivyQt->limitsFor(name));
+
+        if (ivyQt->resolveDuplicateClient(this)) return;
+
+        if (!subscriptionsSent) sendSubscriptions();
+    }
 
     // Message Type 8: Die Message
     // We are being asked politely to die
@@ -204,35 +670,84 @@ void IvyClient::processMessage(IvyMessage *msg)
 }
 
 // will add EOL here
-int IvyClient::sendMessage(MsgType type, quint32 identifier, QByteArray *data)
+// A deadline only applies to bulk frames held back by congestion
+int IvyClient::sendMessage(MsgType type, quint32 identifier, QByteArray *data, qint64 deadline)
 {
-    QByteArray msg;
-    msg.append(QString::number(type).toUtf8());
-    msg.append(' ');
-    msg.append(QString::number(identifier).toUtf8());
-    msg.append(ARG_START);
+    if (!socket->isValid()) return false;
+
+    char header[IvyMessage::maxHeaderLength];
+    int headerLength = IvyMessage::encodeHeader(type, identifier, header);
+
+    if (isBulk(type)) {
+        QByteArray payload;
+        payload.reserve((data ? data->size() : 0) + 1);
+        if (data) payload.append(*data);
+        payload.append('\n');
+        sendBulkFrame(type,identifier,QByteArray(header,headerLength),payload,false,deadline);
+        return false;
+    }
 
-    if (data != 0) msg.append(*data);
+    // Control frames are encoded in place, keeping its capacity
+    encodeBuffer.resize(0);
+    encodeBuffer.append(header, headerLength);
+    if (data) encodeBuffer.append(*data);
+    encodeBuffer.append('\n');
+
+    writeFrames(encodeBuffer);
+    logMessageStats(type,Out);
+
+    if (ivyQt->isLogging(1)) {
+        QString message = QString("LOCAL -> %1:%2 %3")
+                .arg(socket->peerAddress().toString())
+                .arg(QString::number(socket->peerPort()))
+                .arg(QString(encodeBuffer.left(encodeBuffer.size() - 1)))
+                .append("<EOL>");
+        ivyQt->logMessage(&message,1);
+    }
 
-    QString message = QString("LOCAL -> %1:%2 %3")
-            .arg(socket->peerAddress().toString())
-            .arg(QString::number(socket->peerPort()))
-            .arg(QString(msg))
-            .append("<EOL>");
+    return false;
+}
 
-    msg.append("\n");
+const QByteArray &IvyClient::msgHeader(quint16 identifier)
+{
+    QHash<quint16, QByteArray>::iterator it = msgHeaders.find(identifier);
+    if (it == msgHeaders.end()) {
+        char header[IvyMessage::maxHeaderLength];
+        int headerLength = IvyMessage::encodeHeader(Msg, identifier, header);
+        it = msgHeaders.insert(identifier, QByteArray(header, headerLength));
+    }
+    return it.value();
+}
 
-    if (socket->isValid()) {
-        logTrafficStats(TCP,Out,socket->write(msg));
-        logMessageStats(type,Out);
-        ivyQt->logMessage(&message,1);
+// Write already encoded frames in a single socket write
+// Held while a bulk frame is partly written, then written after it
+// Message statistics are left to the caller
+int IvyClient::writeFrames(const QByteArray &frames)
+{
+    if (!socket->isValid()) return true;
+
+    if (bulkLaneOffset) {
+        controlBacklog.append(frames);
+        return false;
     }
 
+    logTrafficStats(TCP,Out,socket->write(frames));
+
+    return false;
+}
+
+int IvyClient::writeBulk(const char *data, qint64 size)
+{
+    if (!socket->isValid()) return true;
+
+    logTrafficStats(TCP,Out,socket->write(data, size));
+
     return false;
 }
 
 void IvyClient::sendBye()
 {
+    if (bulkLaneOffset) completePartialFrame();
     sendMessage(Bye,0);
 
     // Disconnect TCP Connection
@@ -282,6 +797,27 @@ void IvyClient::IvySendDieMsg(void)
     }
 }
 
+// Close a connection which lost the duplicate tie-break
+// Signals are detached first so the peer going away is not
+// reported as a Bye for the surviving connection
+void IvyClient::dropDuplicate()
+{
+    duplicate = true;
+    ready = false;
+
+    socket->disconnect(this);
+
+    emit ivyQt->logMessage(QString("Closing duplicate connection to %1 (%2:%3)")
+                           .arg(name)
+                           .arg(socket->peerAddress().toString())
+                           .arg(QString::number(socket->peerPort())),1);
+
+    connect(socket, SIGNAL(disconnected()), socket, SLOT(deleteLater()));
+    socket->disconnectFromHost();
+    if (socket->state() == QAbstractSocket::UnconnectedState)
+        socket->deleteLater();
+}
+
 void IvyClient::processPong(qint16 id)
 {
     qint64 elapsedTimeus = pingElapsedTimer.nsecsElapsed() / 1000;
@@ -305,20 +841,65 @@ void IvyClient::processBye()
     emit ivyClientBye(this, receivedByeRequest);
 }
 
+// One of our pending rows has been compiled
+void IvyClient::subscriptionCompiled()
+{
+    pendingSubscriptionCount--;
+
+    if (endRegexpPending && !pendingSubscriptionCount) {
+        endRegexpPending = false;
+        setReady();
+    }
+}
+
 void IvyClient::setReady(bool value)
 {
     this->ready = value;
-    if (isReady()) emit ivyClientReady(this);
+    if (isReady()) {
+        if (timeToReady < 0)
+            timeToReady = handshakeElapsedTimer.nsecsElapsed() / 1000;
+        emit ivyClientReady(this);
+    }
 }
 
-// Return a pointer to Subscription from identifier
-// Returns a NULL pointer if not found
-Subscription* IvyClient::subscriptionByIdentifier(quint16 identifier)
+// Return the pattern subscribed with identifier
+// Returns a null QString if not found
+QString IvyClient::subscriptionPattern(quint16 identifier)
 {
-    Subscription *subscription = NULL;
-    for(int i = 0; i < subscriptions.count(); i++)
-        if (subscriptions.at(i)->identifier == identifier) subscription = subscriptions.at(i);
-    return subscription;
+    int row = ivyQt->remoteSubscriptions.find(subscriptionPeer, identifier);
+    if (row < 0) return QString();
+    return ivyQt->remoteSubscriptions.regexps.at(ivyQt->remoteSubscriptions.patterns.at(row)).pattern();
+}
+
+// Open the handshake with our StartRegexp. When this connection
+// cannot lose the duplicate tie-break our subscriptions are
+// pipelined behind it in the same write rather than waiting a
+// round trip for the peer's StartRegexp
+void IvyClient::sendHandshake()
+{
+    if (!ivyQt->mayPipelineSubscriptions(this)) {
+        sendPeerId();
+        return;
+    }
+
+    QByteArray data = ivyQt->agentName.toUtf8();
+    QByteArray frames = IvyMessage::encode(StartRegexp,ivyQt->localTcpPort,&data);
+    frames.append(ivyQt->encodedSubscriptions(this));
+
+    if (writeFrames(frames)) return;
+
+    int count = ivyQt->advertisedSubscriptionCount(this);
+    logMessageStats(StartRegexp,Out);
+    for (int i = 0; i < count; i++)
+        logMessageStats(AddRegexp,Out);
+    logMessageStats(EndRegexp,Out);
+
+    subscriptionsSent = true;
+
+    emit ivyQt->logMessage(QString("LOCAL -> %1:%2 StartRegexp with %3 subscriptions")
+                           .arg(socket->peerAddress().toString())
+                           .arg(QString::number(socket->peerPort()))
+                           .arg(QString::number(count)),1);
 }
 
 void IvyClient::sendPeerId()
@@ -327,32 +908,45 @@ void IvyClient::sendPeerId()
     sendMessage(StartRegexp,ivyQt->localTcpPort,&data);
 }
 
-int IvyClient::sendTextMessage(quint16 ident, QList<QByteArray*> *parameters)
+// Conflated messages are held rather than queued behind unsent data
+// when the peer is congested, replacing any older held message for
+// the same subscription
+int IvyClient::sendTextMessage(quint16 ident, QList<QByteArray*> *parameters, bool conflate, qint64 deadline)
 {
-    // Buil Parameter String from QList of parameters
-    QByteArray data;
-    for(int i = 0; i < parameters->count(); i++) {
-        data.append(*parameters->at(i));
-        data.append(0x03); // always trails a parameter
-    }
+    return sendTextPayload(ident, IvyMessage::encodePayload(*parameters), conflate, deadline);
+}
 
-    sendMessage(Msg,ident,&data);
+// Payload from IvyMessage::encodePayload, possibly shared by peers
+int IvyClient::sendTextPayload(quint16 ident, const QByteArray &payload, bool conflate, qint64 deadline)
+{
+    return sendBulkFrame(Msg, ident, msgHeader(ident), payload, conflate, deadline);
+}
 
-    return false;
+// Point to point message, no subscription involved
+int IvyClient::sendDirectMessage(quint32 identifier, const QByteArray &payload)
+{
+    QByteArray data = payload;
+    return sendMessage(DirectMsg,identifier,&data);
 }
 
 // Send subscriptions to remote client
+// The AddRegexp list and EndRegexp are encoded once by IvyQt
+// and shared by every client in a single write
 void IvyClient::sendSubscriptions()
 {
-    QByteArray data;
-    // Iterate through local subscriptions
-    for(int i = 0; i < ivyQt->subscriptions.count(); i++) {
-        // Build TCP Text Message (Message Type 1)
-        data = ivyQt->subscriptions.at(i)->pattern().toUtf8();
-        sendMessage(AddRegexp,ivyQt->subscriptions.at(i)->identifier,&data);
-        data.clear();
-    }
-    sendMessage(EndRegexp,0);
+    if (writeFrames(ivyQt->encodedSubscriptions(this))) return;
+
+    int count = ivyQt->advertisedSubscriptionCount(this);
+    for(int i = 0; i < count; i++)
+        logMessageStats(AddRegexp,Out);
+    logMessageStats(EndRegexp,Out);
+
+    subscriptionsSent = true;
+
+    emit ivyQt->logMessage(QString("LOCAL -> %1:%2 %3 subscriptions")
+                           .arg(socket->peerAddress().toString())
+                           .arg(QString::number(socket->peerPort()))
+                           .arg(QString::number(count)),1);
 }
 
 // Update subscription to client based on pointer to Subscription
@@ -392,8 +986,20 @@ void IvyClient::onPingTimeoutTimerTimeout()
     qDebug() << "Ping timeout";
 }
 
+// Accumulate stage latencies of a dispatched message
+void IvyClient::traceMessage(IvyMessage *msg)
+{
+    if (!msg->trace[TraceRead] || !msg->trace[TraceDispatched]) return;
+
+    for (int i = TraceFramed; i < TraceStageCount; i++)
+        latency[i].add(msg->trace[i] - msg->trace[i-1]);
+    latency[TraceRead].add(msg->trace[TraceDispatched] - msg->trace[TraceRead]);
+}
+
 void IvyClient::logMessageStats(quint8 type, BusTrafficDirection direction)
 {
+    if (type > Pong) return; // unknown type, not counted
+
     switch (direction) {
     case In:
         messageCountStatsIn[type]++;
@@ -404,8 +1010,12 @@ void IvyClient::logMessageStats(quint8 type, BusTrafficDirection direction)
         messageCountStatsOut[type]++;
         messageCountTotalOut++;
         break;
+
+    default:
+        break;
     }
 
+    ivyQt->on_ivyBusMessageStats(type,direction,this);
     emit ivyBusMessageStats(type,direction,this);
 }
 
@@ -417,5 +1027,6 @@ void IvyClient::logTrafficStats(BusTrafficProtocol protocol, BusTrafficDirection
         if (direction == Out) statsTcpBytesOut += bytes;
     }
 
+    ivyQt->on_ivyBusTrafficStats(direction,bytes,protocol,this);
     emit ivyBusTrafficStats(direction,bytes,protocol,this);
 }
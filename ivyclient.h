@@ -5,10 +5,14 @@
 #include <QHostAddress>
 #include <QTcpSocket>
 #include <QList>
+#include <QMap>
+#include <QHash>
+#include <QVector>
 
 #include "subscription.h"
 #include "ivyqt.h"
 #include "ivymessage.h"
+#include "ivylatency.h"
 
 #include <QTimer>
 #include <QElapsedTimer>
@@ -16,6 +20,17 @@
 class IvyQt;
 class IvyMessage;
 
+// Frame waiting in an outbound lane
+// The payload is shared with every other peer sent the same message
+typedef struct {
+    QByteArray header; // "<type> <id><STX>"
+    QByteArray payload; // up to and including EOL, empty when conflated
+    MsgType type;
+    quint16 identifier;
+    bool conflated;
+    qint64 deadline; // ivyTraceNow() nanoseconds, 0 never expires
+} IvyOutboundFrame;
+
 class IvyClient : public QObject
 {
     Q_OBJECT
@@ -23,12 +38,15 @@ class IvyClient : public QObject
 public:
 
     static const quint16 pingTimeoutSeconds = 30;
+    static const int writeChunkSize = 32 * 1024; // bulk frames larger are streamed
+    static const int maxLoggedPayload = 1024;
 
     IvyClient(IvyQt *ivyQt, QHostAddress *host, quint16 *port, QString *name, QByteArray *appId = 0, QObject *parent = 0);
     IvyClient(IvyQt *ivyQt, QTcpSocket* socket, QObject *parent = 0);
 
     void init();
 
+    void sendHandshake();
     void sendPeerId();
     void sendBye();
     void IvySendPing(void);
@@ -40,15 +58,26 @@ public:
     void updateSubscription(Subscription *subscription);
     void deleteSubscription(quint16 identifier);
 
-    int sendMessage(MsgType type, quint32 identifier, QByteArray *data = 0);
+    int sendMessage(MsgType type, quint32 identifier, QByteArray *data = 0, qint64 deadline = 0);
+    int writeFrames(const QByteArray &frames);
 
     int start();
-    int sendTextMessage(quint16 ident, QList<QByteArray*> *parameters);
+    int sendTextMessage(quint16 ident, QList<QByteArray*> *parameters, bool conflate = false, qint64 deadline = 0);
+    int sendTextPayload(quint16 ident, const QByteArray &payload, bool conflate = false, qint64 deadline = 0);
+
+    // Encoded "2 <id><STX>" per remote subscription
+    QHash<quint16, QByteArray> msgHeaders;
+    const QByteArray &msgHeader(quint16 identifier);
+
+    // Reused for every control frame
+    QByteArray encodeBuffer;
+    int sendDirectMessage(quint32 identifier, const QByteArray &payload);
     int sendSubscribeMessage(quint16 ident, QString *expression);
 
     IvyQt *ivyQt;
 
     QHostAddress *hostAddress;
+    quint32 peerId; // unique within this IvyQt
     quint16 port;
     QByteArray appId;
     QString name;
@@ -56,16 +85,63 @@ public:
     bool ready;
     bool isReady() { return ready; }
 
-    QTcpSocket *socket;
-    QByteArray rcvBuffer;
+    // Connection handshake state
+    bool outgoing; // we initiated the TCP connection
+    bool peerIdReceived; // remote StartRegexp processed
+    bool subscriptionsSent;
+    bool duplicate; // dropped in favour of another connection to same peer
+    bool member; // hub side connection from a hub member
+    bool cached; // connected from the peer cache, identity unconfirmed
+
+    void dropDuplicate();
 
-    QList<Subscription*> subscriptions;
-    Subscription* subscriptionByIdentifier(quint16 identifier);
+    // Time from connection start to peer EndRegexp, -1 until ready
+    QElapsedTimer handshakeElapsedTimer;
+    qint64 timeToReady; // microseconds
 
-    QList<IvyMessage*> messages;
+    QTcpSocket *socket;
+    QByteArray rcvBuffer; // holds an incomplete trailing frame between reads
+    QVector<int> rcvDelimiters; // EOL, STX and ETX offsets in rcvBuffer
+    int rcvScanned; // bytes of rcvBuffer already in rcvDelimiters
+
+    // Remote subscriptions are rows of IvyQt::remoteSubscriptions
+    int subscriptionPeer; // peer index of our rows, -1 once removed
+    int pendingSubscriptionCount; // rows whose pattern is being compiled
+    int subscriptionCount; // rows in use
+    qint64 subscriptionBytes; // pattern text of those rows
+    bool endRegexpPending; // ready once nothing is pending
+    void subscriptionCompiled();
+    QString subscriptionPattern(quint16 identifier);
+
+    QList<IvyMessage*> messages; // oldest first, see retainMessage
+
+    // Outbound priority lanes
+    // Control frames are written straight to the socket. Msg and
+    // DirectMsg frames form the bulk lane, queued here once the
+    // socket holds congestionThreshold unsent bytes, so control
+    // frames never wait behind more than that amount of bulk data
+    static bool isBulk(MsgType type) { return (type == Msg || type == DirectMsg); }
+    // Frames above writeChunkSize are written a chunk at a time as
+    // the socket drains, control frames wait for a partly written one
+    QList<IvyOutboundFrame> bulkLane;
+    qint64 bulkLaneBytes;
+    qint64 bulkLaneOffset; // bytes of the first frame already written
+    QByteArray controlBacklog;
+    qint64 congestionThreshold();
+    int sendBulkFrame(MsgType type, quint16 identifier, const QByteArray &header, const QByteArray &payload, bool conflate = false, qint64 deadline = 0);
+    void flushBulkLane();
+    int writeChunk(const IvyOutboundFrame &outbound);
+    int writeBulk(const char *data, qint64 size);
+    void completePartialFrame();
+    void writeControlBacklog();
+
+    // Latest unsent Msg frame per conflated subscription
+    QHash<quint16, IvyOutboundFrame> conflatedFrames;
 
     void processMessage(IvyMessage *msg);
 
+    void logMessageStats(quint8 type, BusTrafficDirection direction);
+
     QElapsedTimer pingElapsedTimer;
     QTimer pingTimeoutTimer;
     quint16 pingId;
@@ -76,18 +152,59 @@ public:
     quint32 statsUdpBytesIn;
     quint32 statsUdpBytesOut;
 
-    quint16 messageCountStatsIn[10];
-    quint16 messageCountStatsOut[10];
+    quint16 messageCountStatsIn[11]; // indexed by MsgType
+    quint16 messageCountStatsOut[11];
     quint16 messageCountTotalIn;
     quint16 messageCountTotalOut;
+    quint32 statsConflatedFrames; // replaced before being sent
+    quint32 statsBulkQueuedFrames; // held in bulk lane before being sent
+    quint32 statsExpiredFrames; // discarded from bulk lane past deadline
+    IvyTransport transport; // socket profile in use
+
+    // Socket options are applied now if connected, else on connect
+    void setTransport(IvyTransport transport);
+    void applyTransport();
+    IvyTransportProfile transportProfile;
+
+    // Resource limits, see IvyQt::setPeerLimits
+    // A breach either closes the connection or drops what exceeded
+    // the limit: the oversized frame, the binding, which is answered
+    // with an Error, or outbound Msg frames until the queue has
+    // drained to half the limit
+    IvyPeerLimits limits;
+    void setLimits(const IvyPeerLimits &limits);
+    bool limitExceeded(IvyPeerLimit limit, qint64 value);
+    bool closing; // connection closing after a breach
+    bool discardingFrame; // rest of an oversized frame still arriving
+    bool outboundLimited; // outbound frames dropped until drained
+    qint64 outboundBytes() { return bulkLaneBytes + socket->bytesToWrite(); }
+
+    // Estimate of the memory held for this peer: buffers, queued
+    // frames, subscription rows and retained received messages
+    qint64 memoryUsage();
+    bool retainMessage(IvyMessage *msg);
+    qint64 statsRetainedMessageBytes;
+    quint32 statsLimitBreaches;
+    quint32 statsOversizedFrames; // received and dropped
+    quint32 statsRejectedSubscriptions;
+    quint32 statsDroppedFrames; // outbound, over the limit
+
+    // Per stage latency of received messages when tracing is enabled
+    // Index is the stage ended, TraceRead holds read to dispatched
+    IvyLatencyHistogram latency[TraceStageCount];
+    void traceMessage(IvyMessage *msg);
 
 private:
 
     void setReady(bool value = true);
     bool receivedByeRequest;
 
+    void rejectSubscription(quint16 identifier, IvyPeerLimit limit, qint64 value);
+    void readRemaining();
+    void discardHeldFrame(quint16 identifier);
+    void removeSubscription(quint16 identifier);
+
     void logTrafficStats(BusTrafficProtocol type, BusTrafficDirection direction, quint16 bytes);
-    void logMessageStats(quint8 type, BusTrafficDirection direction);
 
     // (qint16 bytes);
     void statsTcpOut(qint16 bytes);
@@ -100,12 +217,14 @@ signals:
     void ivyClientBye(IvyClient *ivyClient, bool graceful = true);
 
     void ivyMessageReceived(IvyMessage* ivymsg);
+    void ivyDirectMessageReceived(IvyMessage* ivymsg);
     void ivyPongReceived(IvyClient* client, qint16 id, qint64 roundtrip);
 
     void ivyBusTrafficStats(BusTrafficDirection direction, qint32 bytes, BusTrafficProtocol, IvyClient* client = 0);
     void ivyBusMessageStats(quint8 type, BusTrafficDirection direction, IvyClient* client = 0);
 
-    void ivyClientSubscription(IvyClient *client, Subscription *subscription, bool change);
+    void ivyClientSubscription(IvyClient *client, quint16 identifier, const QString &pattern, bool change);
+    void ivyClientSubscriptionDeleted(IvyClient *client, quint16 identifier);
 
 public slots:
 
@@ -114,6 +233,7 @@ public slots:
 
     void onSocketBytesWritten(qint64 bytes);
     void onPingTimeoutTimerTimeout();
+    void abortConnection();
 
 };
 
@@ -0,0 +1,56 @@
+#include "ivylatency.h"
+
+#include <QElapsedTimer>
+#include <string.h>
+
+// Started on first use, before any trace point can be taken
+static QElapsedTimer *traceClock()
+{
+    static struct Clock {
+        Clock() { timer.start(); }
+        QElapsedTimer timer;
+    } clock;
+    return &clock.timer;
+}
+
+qint64 ivyTraceNow()
+{
+    return traceClock()->nsecsElapsed();
+}
+
+void IvyLatencyHistogram::clear()
+{
+    count = 0;
+    total = 0;
+    maximum = 0;
+    memset(buckets, 0, sizeof(buckets));
+}
+
+void IvyLatencyHistogram::add(qint64 nanoseconds)
+{
+    if (nanoseconds < 0) nanoseconds = 0;
+
+    int bucket = 0;
+    while (bucket < bucketCount - 1 && (nanoseconds >> bucket)) bucket++;
+
+    buckets[bucket]++;
+    count++;
+    total += nanoseconds;
+    if (nanoseconds > maximum) maximum = nanoseconds;
+}
+
+// Upper bound of the bucket holding the requested fraction
+// of samples, e.g. percentile(0.99)
+qint64 IvyLatencyHistogram::percentile(double fraction) const
+{
+    if (!count) return 0;
+
+    quint64 target = fraction * count;
+    quint64 seen = 0;
+    for (int i = 0; i < bucketCount; i++) {
+        seen += buckets[i];
+        if (seen > target) return qMin((qint64)1 << i, maximum);
+    }
+
+    return maximum;
+}
@@ -0,0 +1,43 @@
+#ifndef IVYLATENCY_H
+#define IVYLATENCY_H
+
+#include <QtGlobal>
+
+// Points at which an inbound message is timestamped when
+// latency tracing is enabled
+typedef enum {
+    TraceRead = 0,      // socket readyRead handled
+    TraceFramed = 1,    // EOL located, frame complete
+    TraceParsed = 2,    // IvyMessage constructed
+    TraceMatched = 3,   // local subscription resolved
+    TraceDispatched = 4, // slot invoked and signal emitted
+    TraceStageCount = 5
+} IvyTraceStage;
+
+// Monotonic nanosecond clock shared by all trace points
+qint64 ivyTraceNow();
+
+// Log2 histogram of nanosecond latencies
+// Bucket n counts samples in [2^(n-1), 2^n)
+class IvyLatencyHistogram
+{
+public:
+
+    static const int bucketCount = 42; // last bucket ends at 2^41 ns, ~36.6 minutes, and holds anything longer
+
+    IvyLatencyHistogram() { clear(); }
+
+    void clear();
+    void add(qint64 nanoseconds);
+
+    qint64 mean() const { return count ? total / count : 0; }
+    qint64 percentile(double fraction) const;
+
+    quint64 count;
+    quint64 total;
+    qint64 maximum;
+    quint64 buckets[bucketCount];
+
+};
+
+#endif // IVYLATENCY_H
@@ -1,11 +1,16 @@
 #include "ivymessage.h"
+#include "ivytokenizer.h"
+
+#include <string.h>
 
 IvyMessage::IvyMessage(IvyClient *client) :
     QObject(client)
 {
+    this->data = 0;
     this->client = client;
-    this->subscription = 0;
     this->identifier = -1;
+    this->m_time = QDateTime::currentMSecsSinceEpoch();
+    memset(trace, 0, sizeof(trace));
 
     valid = false;
 }
@@ -13,49 +18,141 @@ IvyMessage::IvyMessage(IvyClient *client) :
 IvyMessage::IvyMessage(QByteArray *data, IvyClient *client) :
     QObject(client)
 {
-    this->subscription = 0;
+    init(data, client);
+
+    // Trim message of EOL char if exists
+    if (data->endsWith('\n')) data->chop(1);
+
+    QVector<int> delimiters;
+    ivyScanDelimiters(data->constData(), data->size(), &delimiters);
+    parse(delimiters.constData(), delimiters.count(), 0);
+}
+
+// Frame already located by IvyClient in its receive buffer
+// Delimiters are the STX and ETX offsets within that buffer,
+// base is the offset of the first byte of the frame
+IvyMessage::IvyMessage(QByteArray *data, const int *delimiters, int delimiterCount, int base, IvyClient *client) :
+    QObject(client)
+{
+    init(data, client);
+    parse(delimiters, delimiterCount, base);
+}
+
+void IvyMessage::init(QByteArray *data, IvyClient *client)
+{
     this->data = data;
     this->client = client;
-    this->m_date = this->m_date.currentDateTime();
-    this->identifier -1;
+    this->m_time = QDateTime::currentMSecsSinceEpoch();
+    memset(trace, 0, sizeof(trace));
+    this->identifier = -1;
+}
 
-    // Trim message of EOL char if exists
-    if (data->right(1).data() == "\n") data->remove(data->count()-1,1);
+// Split frame using delimiter positions from ivyScanDelimiters
+void IvyMessage::parse(const int *delimiters, int delimiterCount, int base)
+{
+    const char *frame = data->constData();
+    int size = data->size();
 
     // Process Message Type
     this->type = (MsgType)data->left(2).trimmed().toInt();
 
     // Recover STX location if present
-    stxPos = data->indexOf(2);
+    int first = 0;
+    stxPos = -1;
+    for (; first < delimiterCount; first++) {
+        if (frame[delimiters[first] - base] == ARG_START) {
+            stxPos = delimiters[first] - base;
+            first++;
+            break;
+        }
+    }
 
     // Locate Identifier
     // TODO: Is this OK? Concerned it doesnt look wide enough
     if(stxPos>=0)
         identifier = data->mid(2,stxPos-2).toInt();
 
-    // Message Type 1: Subscription
-    if (type == AddRegexp) {
-        QByteArray pattern = data->mid(stxPos+1,data->length()-stxPos-1);
-        subscription = new Subscription(identifier,&pattern,client);
-    }
-
     // Message Type 2: Message (with regexp response)
-    if (type == Msg) {
-        parameters = data->mid(stxPos+1,data->length()-stxPos-1).split(ARG_END);
-        parameters.removeLast();
-    }
-
     // Message Type 6: Start Regexp
-    if (type == StartRegexp)
-    {
-        // Split message by ETX character (0x03)
-        this->parameters = data->mid(stxPos+1,data->size()-stxPos+1).split(0x03);
-        if (!this->parameters.last().size()) this->parameters.removeLast(); // remove trailing empty
+    // Fields are terminated by ETX (0x03), text after the last
+    // one is dropped for Msg and kept for StartRegexp
+    if (type == Msg || type == StartRegexp) {
+        int start = stxPos + 1;
+        for (int i = first; i < delimiterCount; i++) {
+            int position = delimiters[i] - base;
+            if (frame[position] != ARG_END) continue;
+            parameters.append(QByteArray(frame + start, position - start));
+            start = position + 1;
+        }
+        if (type == StartRegexp && start < size)
+            parameters.append(QByteArray(frame + start, size - start));
     }
 
+    // Message Type 1: Subscription
+    // Message Type 7: Direct Message
+    // Pattern or opaque payload, carried as a single parameter
+    if (type == AddRegexp || type == DirectMsg)
+        parameters.append(data->mid(stxPos+1));
+
     // TODO: increase checking
     valid = true;
+}
+
+// Encode a single frame including trailing EOL
+// Example: "2 12<STX>arg1<ETX>arg2<ETX><EOL>"
+QByteArray IvyMessage::encode(MsgType type, quint32 identifier, const QByteArray *data)
+{
+    char header[maxHeaderLength];
+    int headerLength = encodeHeader(type, identifier, header);
+
+    QByteArray msg;
+    msg.reserve(headerLength + (data ? data->size() : 0) + 1);
+    msg.append(header, headerLength);
+
+    if (data != 0) msg.append(*data);
+
+    msg.append('\n');
+
+    return msg;
+}
+
+// Integers are formatted by hand, no QString or QByteArray
+int IvyMessage::encodeHeader(MsgType type, quint32 identifier, char *buffer)
+{
+    int length = 0;
+
+    if (type >= 10) buffer[length++] = '0' + type / 10;
+    buffer[length++] = '0' + type % 10;
+    buffer[length++] = ' ';
+
+    char digits[10];
+    int count = 0;
+    do {
+        digits[count++] = '0' + identifier % 10;
+        identifier /= 10;
+    } while (identifier);
+    while (count) buffer[length++] = digits[--count];
+
+    buffer[length++] = ARG_START;
+
+    return length;
+}
+
+QByteArray IvyMessage::encodePayload(const QList<QByteArray*> &parameters)
+{
+    int size = 1;
+    for (int i = 0; i < parameters.count(); i++)
+        size += parameters.at(i)->size() + 1;
+
+    QByteArray payload;
+    payload.reserve(size);
+    for (int i = 0; i < parameters.count(); i++) {
+        payload.append(*parameters.at(i));
+        payload.append(ARG_END); // always trails a parameter
+    }
+    payload.append('\n');
 
+    return payload;
 }
 
 QString IvyMessage::getPeerName()
@@ -6,6 +6,7 @@
 #include "ivyqt.h"
 #include "ivyclient.h"
 #include "subscription.h"
+#include "ivylatency.h"
 
 class IvyClient;
 
@@ -16,6 +17,8 @@ class IvyMessage : public QObject
 public:
     explicit IvyMessage(IvyClient *client = 0);
     IvyMessage(QByteArray *data, IvyClient *client = 0);
+    IvyMessage(QByteArray *data, const int *delimiters, int delimiterCount, int base, IvyClient *client = 0);
+    ~IvyMessage() { delete data; }
 
     // Raw Data
     QByteArray *data;
@@ -25,20 +28,34 @@ public:
     QList<QByteArray> parameters;
     QString content();
 
-    Subscription *subscription;
     IvyClient *client;
 
-    QDateTime date() { return m_date; }
+    QDateTime date() { return QDateTime::fromMSecsSinceEpoch(m_time); }
+
+    // Monotonic trace points, zero unless latency tracing is enabled
+    qint64 trace[TraceStageCount];
 
     bool isValid() { return valid; }
     QString getPeerName();
 
+    static QByteArray encode(MsgType type, quint32 identifier, const QByteArray *data = 0);
+
+    // "<type> <id><STX>" written to buffer, returns its length
+    static const int maxHeaderLength = 16;
+    static int encodeHeader(MsgType type, quint32 identifier, char *buffer);
+
+    // Captures each followed by ETX, then EOL
+    static QByteArray encodePayload(const QList<QByteArray*> &parameters);
+
 private:
 
+    void init(QByteArray *data, IvyClient *client);
+    void parse(const int *delimiters, int delimiterCount, int base);
+
     bool valid;
-    qint16 stxPos;
+    int stxPos;
 
-    QDateTime m_date; // sent or received
+    qint64 m_time; // sent or received, msecs since epoch
 
 signals:
 
@@ -1,8 +1,14 @@
 #include "ivyqt.h"
 
 #include <QDebug>
+#include <QMetaMethod>
+#include <QFile>
+#include <QSaveFile>
+#include <QThread>
+#include <string.h>
 
 const QString IvyQt::defaultBusNetwork = "127:2010";
+const QString IvyQt::hubCatchAllPattern = "^(.*)$";
 
 IvyQt::IvyQt(QObject *parent) :
     QObject(parent)
@@ -18,6 +24,13 @@ IvyQt::IvyQt(QString name, QObject *parent) :
     init();
 }
 
+// Posted messages never drained are discarded
+IvyQt::~IvyQt()
+{
+    IvyPostedMsg *node;
+    while ((node = popPostedMsg())) delete node;
+}
+
 void IvyQt::init()
 {
     obeyDieRequest = true;
@@ -25,6 +38,65 @@ void IvyQt::init()
     // Apply default log level
     _logLevel = defaultLogLevel;
 
+    subscriptionFramesValid = false;
+    busTimeToReady = -1;
+
+    QByteArray catchAll = hubCatchAllPattern.toUtf8();
+    memberSubscriptionFrames = IvyMessage::encode(AddRegexp,hubCatchAllIdentifier,&catchAll);
+    memberSubscriptionFrames.append(IvyMessage::encode(EndRegexp,0));
+
+    statsTcpBytesIn = 0;
+    statsTcpBytesOut = 0;
+    statsUdpBytesIn = 0;
+    statsUdpBytesOut = 0;
+    memset(messageCountStatsIn, 0, sizeof(messageCountStatsIn));
+    memset(messageCountStatsOut, 0, sizeof(messageCountStatsOut));
+    statsHubMemberMessages = 0;
+    statsHubRelayedMessages = 0;
+    statsFilteredBindings = 0;
+
+    matchProfiling = false;
+    matchTimeBudget = 0;
+    statsQuarantinedSubscriptions = 0;
+
+    lastValueCaching = false;
+    maxLastValues = defaultLastValueEntries;
+    statsLastValueReplays = 0;
+    statsLastValuesDropped = 0;
+
+    role = AgentRole;
+    hubPort = 0;
+    hubServer = 0;
+    nextRelayIdentifier = hubRelayIdentifierBase;
+
+    nextPeerId = 0;
+    recorder = 0;
+    latencyTracing = false;
+
+    congestionThreshold = defaultCongestionThreshold;
+    defaultTransport = DefaultTransport;
+    defaultPeerLimits = unlimited();
+
+    // Leave a core for the event loop
+    backgroundCompilation = true;
+    nextCompileJob = 1; // 0 marks no job
+    compilePool.setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+
+    peerCacheSaveTimer.setSingleShot(true);
+    connect(&peerCacheSaveTimer, SIGNAL(timeout()), this, SLOT(savePeerCache()));
+
+    batchWindow = 0;
+    batchTimer.setSingleShot(true);
+    connect(&batchTimer, SIGNAL(timeout()), this, SLOT(flushBatches()));
+
+    bindTransactionDepth = 0;
+    pendingBindAddCount = 0;
+    pendingBindDelCount = 0;
+
+    postStub.deadline = 0;
+    postHead.store(&postStub);
+    postTail = &postStub;
+
     // Default to any available interface
     localTcpAddress = QHostAddress::Any;
 
@@ -45,6 +117,112 @@ void IvyQt::IvyInit(char *appName, char *readyMsg)
 // Return -1 if error
 int IvyQt::IvyBind(const QString *pattern, QObject *receiver, const char *member)
 {
+    IvyBeginBind();
+    int identifier = bind(pattern, receiver, member);
+    IvyCommitBind();
+
+    // Return Subscription Identifier
+    return identifier;
+}
+
+// Bind a list of patterns to the same receiver
+// Identifiers are returned in pattern order, -1 if error
+QList<int> IvyQt::IvyBindMany(const QStringList &patterns, QObject *receiver, const char *member)
+{
+    QList<int> identifiers;
+
+    IvyBeginBind();
+    for (int i = 0; i < patterns.count(); i++)
+        identifiers.append(bind(&patterns.at(i), receiver, member));
+    IvyCommitBind();
+
+    return identifiers;
+}
+
+int IvyQt::IvyUnBind(quint16 identifier)
+{
+    IvyBeginBind();
+    unbind(identifier);
+    IvyCommitBind();
+
+    return false;
+}
+
+// Return number of bindings removed
+int IvyQt::IvyUnBindMany(const QList<quint16> &identifiers)
+{
+    int removed = 0;
+
+    IvyBeginBind();
+    for (int i = 0; i < identifiers.count(); i++)
+        if (unbind(identifiers.at(i))) removed++;
+    IvyCommitBind();
+
+    return removed;
+}
+
+int IvyQt::IvyClearBindings()
+{
+    QList<quint16> identifiers;
+    for (int i = 0; i < subscriptions.count(); i++)
+        identifiers.append(subscriptions.at(i)->identifier);
+
+    return IvyUnBindMany(identifiers);
+}
+
+// Bind transactions defer propagation of new and deleted
+// subscriptions until the outermost IvyCommitBind, which
+// sends them to each peer in a single write
+void IvyQt::IvyBeginBind()
+{
+    bindTransactionDepth++;
+}
+
+void IvyQt::IvyCommitBind()
+{
+    if (!bindTransactionDepth) return;
+    if (--bindTransactionDepth) return;
+
+    if (pendingBindFrames.isEmpty()) return;
+
+    // Clients still in handshake receive the changes with
+    // their initial subscription list
+    // Hub members only ever hold the catch-all subscription
+    for (int i = 0; i < this->clients.count(); i++) {
+        IvyClient *client = this->clients.at(i);
+        if (!client->subscriptionsSent || client->member) continue;
+        if (client->writeFrames(pendingBindFrames)) continue;
+
+        for (int j = 0; j < pendingBindAddCount; j++)
+            client->logMessageStats(AddRegexp,Out);
+        for (int j = 0; j < pendingBindDelCount; j++)
+            client->logMessageStats(DelRegexp,Out);
+    }
+
+    logMessage(QString("Propagated %1 new and %2 deleted subscriptions to %3 clients")
+               .arg(QString::number(pendingBindAddCount))
+               .arg(QString::number(pendingBindDelCount))
+               .arg(QString::number(clients.count())),1);
+
+    pendingBindFrames.clear();
+    pendingBindAddCount = 0;
+    pendingBindDelCount = 0;
+}
+
+// Register a local subscription and queue its AddRegexp
+// for the current bind transaction
+int IvyQt::bind(const QString *pattern, QObject *receiver, const char *member)
+{
+    // Validate slot if specified
+    const char* bracketPosition = 0;
+    if (receiver && member) {
+        bracketPosition = strchr(member, '(');
+        if (!bracketPosition || !(member[0] >= '0' && member[0] <= '3')) {
+            qWarning("IvyQt::IvyBind: Invalid slot specification");
+            return -1;
+        }
+    }
+
     // Create new Subscription
     // Create incrementing identifier
     // Add Subscription to local list of subscriptions
@@ -52,15 +230,10 @@ int IvyQt::IvyBind(const QString *pattern, QObject *receiver, const char *member
     if (!subscriptions.count()) sub->setIdentifier(0);
     else sub->setIdentifier(subscriptions.at(subscriptions.count()-1)->identifier+1);
     subscriptions.append(sub);
+    subscriptionFramesValid = false;
 
     // Manage slot if specified
-    if (receiver && member) {
-        const char* bracketPosition = strchr(member, '(');
-        if (!bracketPosition || !(member[0] >= '0' && member[0] <= '3')) {
-            qWarning("IvyQt::IvyBind: Invalid slot specification");
-            return -1;
-        }
-
+    if (bracketPosition) {
         // Extract method name
         sub->slotMember = QByteArray(member+1, bracketPosition - 1 - member);
 
@@ -71,27 +244,29 @@ int IvyQt::IvyBind(const QString *pattern, QObject *receiver, const char *member
         sub->slotReceiver = receiver;
     }
 
-    // Update to connected clients
-    // this will of course do nothing if there are
-    // no connnected clients
-    for (int i = 0; i < this->clients.count(); i++)
-        this->clients.at(i)->updateSubscription(sub);
+    QByteArray data = pattern->toUtf8();
+    pendingBindFrames.append(IvyMessage::encode(AddRegexp,sub->identifier,&data));
+    pendingBindAddCount++;
 
-    // Return Subscription Identifier
     return sub->identifier;
-
 }
 
-int IvyQt::IvyUnBind(quint16 identifier)
+// Remove a local subscription and queue its DelRegexp
+// for the current bind transaction
+bool IvyQt::unbind(quint16 identifier)
 {
-    // Remove
-    subscriptions.removeOne(subscriptionByIdentifier(identifier));
+    Subscription *sub = subscriptionByIdentifier(identifier);
+    if (!sub) return false;
 
-    if (this->active)
-        for (int i = 0; i < this->clients.count(); i++)
-            this->clients.at(i)->deleteSubscription(identifier);
+    subscriptions.removeOne(sub);
+    pendingBatchSubscriptions.removeOne(sub);
+    subscriptionFramesValid = false;
+    delete sub;
 
-    return false;
+    pendingBindFrames.append(IvyMessage::encode(DelRegexp,identifier));
+    pendingBindDelCount++;
+
+    return true;
 }
 
 QByteArray IvyQt::generateAppId(quint16 port)
@@ -197,6 +372,9 @@ void IvyQt::IvyStart(QString networks)
 {
     setNetworks(networks);
 
+    busTimeToReady = -1;
+    busJoinElapsedTimer.start();
+
     // Request TCPServer to listen on all available interfaces
     // todo: limit interfaces to those in networks above
     tcpServer->listen(QHostAddress::Any);
@@ -215,6 +393,10 @@ void IvyQt::IvyStart(QString networks)
     // todo: take into account multiple interfaces and multiple ports!
     appId = generateAppId(localTcpPort);
 
+    // Reconnect to known peers without waiting for their
+    // announcements, which are only made when they start
+    connectCachedPeers();
+
     // Broadcast our presence via UDP Multicast
     broadcast();
 
@@ -228,6 +410,45 @@ void IvyQt::IvyStart(QString networks)
     }
 }
 
+// Join the bus as an agent which also accepts members
+void IvyQt::IvyStartHub(QString networks, quint16 memberPort)
+{
+    role = HubRole;
+
+    IvyStart(networks);
+
+    if (!hubServer) {
+        hubServer = new QTcpServer(this);
+        connect(hubServer, SIGNAL(newConnection()), this, SLOT(onHubServerNewConnection()));
+    }
+
+    hubServer->listen(QHostAddress::Any, memberPort);
+    hubPort = hubServer->serverPort();
+
+    logMessage(QString("Hub accepting members on port %1").arg(QString::number(hubPort)),1);
+}
+
+// Connect to a hub instead of discovering the bus
+// No UDP announcement is made and no TCP port is opened
+void IvyQt::IvyStartMember(const QHostAddress &hubAddress, quint16 hubPort)
+{
+    role = MemberRole;
+
+    busTimeToReady = -1;
+    busJoinElapsedTimer.start();
+
+    localTcpPort = 0;
+    appId = generateAppId(localTcpPort);
+
+    QHostAddress host(hubAddress);
+    quint16 port = hubPort;
+    QString name;
+    addIvyClient(&host,&port,&name);
+
+    active = true;
+    emit joinedIvyBus();
+}
+
 void IvyQt::broadcast()
 {
     QString datagram = QString("3 %1 %2 %3")
@@ -251,6 +472,40 @@ void IvyQt::IvyDie()
     if (obeyDieRequest) IvyStop();
 }
 
+// Return TRUE if recording started
+bool IvyQt::IvyStartRecording(const QString &fileName)
+{
+    IvyStopRecording();
+
+    recorder = new IvyRecorder(this);
+    if (!recorder->open(fileName)) {
+        logMessage(QString("Unable to record to %1").arg(fileName),1);
+        delete recorder;
+        recorder = 0;
+        return false;
+    }
+
+    // Identify peers which are already ready
+    for (int i = 0; i < clients.count(); i++)
+        if (clients.at(i)->isReady())
+            recorder->recordPeer(clients.at(i)->peerId, clients.at(i)->name, clients.at(i)->appId);
+
+    logMessage(QString("Recording to %1").arg(fileName),1);
+
+    return true;
+}
+
+void IvyQt::IvyStopRecording()
+{
+    if (!recorder) return;
+
+    logMessage(QString("Recorded %1 frames").arg(QString::number(recorder->recordCount)),1);
+
+    recorder->close();
+    delete recorder;
+    recorder = 0;
+}
+
 void IvyQt::logMessage(QString *logmsg, quint16 level)
 {
     // Substitute non-printable control characters
@@ -262,6 +517,16 @@ void IvyQt::logMessage(QString *logmsg, quint16 level)
     emit formattedLogMessage(logmsg, level);
 }
 
+// Per message log lines are only worth formatting when
+// someone is listening at that level
+bool IvyQt::isLogging(quint16 level)
+{
+    if (level > _logLevel) return false;
+
+    static const QMetaMethod formattedLogMessageSignal = QMetaMethod::fromSignal(&IvyQt::formattedLogMessage);
+    return isSignalConnected(formattedLogMessageSignal);
+}
+
 void IvyQt::setLogLevel(quint16 level)
 {
     _logLevel = level;
@@ -278,14 +543,32 @@ void IvyQt::IvyStop()
     // and terminate TCP socket connections
     for (int i = 0; i < clients.count(); i++) {
         clients.at(i)->sendBye();
+        clients.at(i)->subscriptionPeer = -1;
         clients.at(i)->deleteLater();
     }
+    remoteSubscriptions.clear();
+    compileJobs.clear();
 
     // Clear local QList of clients
     clients.clear();
+    clientsByName.clear();
+
+    if (peerCacheSaveTimer.isActive()) {
+        peerCacheSaveTimer.stop();
+        savePeerCache();
+    }
 
     // Stop TCP listening
     tcpServer->close();
+    if (hubServer) hubServer->close();
+    hubPort = 0;
+
+    qDeleteAll(relays);
+    relays.clear();
+    relaysByPattern.clear();
+    nextRelayIdentifier = hubRelayIdentifierBase;
+    freeRelayIdentifiers.clear();
+    subscriptionFramesValid = false;
 
     // Stop UDP Socket
     udpSocket->disconnectFromHost();
@@ -299,17 +582,28 @@ void IvyQt::IvyStop()
 // from peer
 //
 void IvyQt::onTcpServerNewConnection()
+{
+    acceptConnections(tcpServer, false);
+}
+
+// Hub member has connected
+void IvyQt::onHubServerNewConnection()
+{
+    acceptConnections(hubServer, true);
+}
+
+void IvyQt::acceptConnections(QTcpServer *server, bool member)
 {
     // Process pending connections
-    while(tcpServer->hasPendingConnections()) {
+    while(server->hasPendingConnections()) {
 
         // Create new IvyClient and pass address of
         // next TCP connection socket
-        IvyClient *client = new IvyClient(this,tcpServer->nextPendingConnection());
+        IvyClient *client = new IvyClient(this,server->nextPendingConnection());
+        client->member = member;
         addIvyClient(client);
 
-        client->sendPeerId();
-        client->sendSubscriptions();
+        client->sendHandshake();
 
         logMessage(QString("New TCP connection from %1:%2").arg(client->socket->peerAddress().toString()).arg(QString::number(client->socket->peerPort())),1);
     }
@@ -378,17 +672,30 @@ int IvyQt::processBroadcastDatagram(QByteArray* datagram, QHostAddress* host, qu
     }
 }
 
+// Compare peer addresses, treating IPv4-mapped IPv6
+// addresses reported by dual stack sockets as IPv4
+static bool isSameHost(const QHostAddress &a, const QHostAddress &b)
+{
+    bool aIsIPv4 = false, bIsIPv4 = false;
+    quint32 a4 = a.toIPv4Address(&aIsIPv4);
+    quint32 b4 = b.toIPv4Address(&bIsIPv4);
+    if (aIsIPv4 && bIsIPv4) return a4 == b4;
+    return a == b;
+}
+
 // Find IvyClient based on Host, Port, and AgentName
-// Return address of IvyClient match
+// Return address of IvyClient match. A peer already connected to
+// us is reported by the dual stack server as ::ffff:a.b.c.d while
+// its UDP announcement comes from a.b.c.d, both are the same host.
 IvyClient* IvyQt::findClient(QHostAddress *host, quint16 *port, QString *name)
 {
     // Iterate QList of IvyClients and return IvyClient*
     // on first match
     for(int i = 0; i < clients.count(); i++)
     {
-        if (clients.at(i)->port != *port) break;
-        if (*clients.at(i)->hostAddress != *host) break;
-        if (clients.at(i)->name != *name) break;
+        if (clients.at(i)->port != *port) continue;
+        if (!isSameHost(*clients.at(i)->hostAddress, *host)) continue;
+        if (clients.at(i)->name != *name) continue;
 
         return clients.at(i);
     }
@@ -397,6 +704,93 @@ IvyClient* IvyQt::findClient(QHostAddress *host, quint16 *port, QString *name)
     return NULL;
 }
 
+// Two agents starting close together each receive the other's
+// announcement and connect, leaving two TCP connections per pair.
+// Once a peer has identified itself with StartRegexp, keep only
+// the connection initiated by the agent with the lower appId.
+// Both ends compare the same pair of appIds so they drop the same
+// connection, before any subscriptions have been exchanged.
+// Returns true if client was the connection dropped
+bool IvyQt::resolveDuplicateClient(IvyClient *client)
+{
+    // Members have no listening port to tell them apart
+    if (client->member) return false;
+
+    for (int i = 0; i < clients.count(); i++) {
+        IvyClient *other = clients.at(i);
+
+        // Incoming connections are anonymous until their StartRegexp
+        if (other == client || other->duplicate || other->member) continue;
+        if (!other->outgoing && !other->peerIdReceived) continue;
+
+        if (other->port != client->port) continue;
+        if (other->name != client->name) continue;
+        if (!isSameHost(*other->hostAddress, *client->hostAddress)) continue;
+
+        IvyClient *loser = client;
+
+        // One connection each way, the outgoing one knows the peer's appId
+        if (client->outgoing != other->outgoing) {
+            IvyClient *outgoing = client->outgoing ? client : other;
+            IvyClient *incoming = client->outgoing ? other : client;
+
+            if (appId < outgoing->appId) loser = incoming;
+            else {
+                loser = outgoing;
+                incoming->appId = outgoing->appId;
+            }
+        }
+
+        dropClient(loser);
+        return (loser == client);
+    }
+
+    return false;
+}
+
+// Subscriptions may be sent ahead of the peer's StartRegexp when
+// this connection is certain to survive the tie-break: either we
+// initiated it and hold the lower appId, or it is incoming while we
+// have no outgoing connection at all. An anonymous incoming
+// connection may come from the peer of any outgoing one, identified
+// or not, so it otherwise waits for the peer's StartRegexp.
+bool IvyQt::mayPipelineSubscriptions(IvyClient *client)
+{
+    if (client->member) return true;
+    if (client->outgoing) return (appId < client->appId);
+
+    for (int i = 0; i < clients.count(); i++)
+        if (clients.at(i)->outgoing && !clients.at(i)->duplicate)
+            return false;
+
+    return true;
+}
+
+// Discard a duplicate connection, silently unless it was already
+// ready: bus users were then told of the peer and see it leave,
+// its relays and name index entry going with it
+void IvyQt::dropClient(IvyClient *client)
+{
+    bool wasReady = client->isReady();
+    client->dropDuplicate();
+
+    if (wasReady) {
+        onIvyClientBye(client);
+        disconnect(client, 0, this, 0);
+        return;
+    }
+
+    disconnect(client, 0, this, 0);
+    clients.removeAll(client);
+    if (clientsByName.value(client->name) == client)
+        clientsByName.remove(client->name);
+    removeRemoteSubscriptions(client);
+
+    // Pending batches may hold its messages
+    flushBatches();
+    client->deleteLater();
+}
+
 int IvyQt::addIvyClient(QHostAddress* host, quint16* port, QString* name, QByteArray* appId)
 {
     // TODO: DEBUG
@@ -407,7 +801,13 @@ int IvyQt::addIvyClient(QHostAddress* host, quint16* port, QString* name, QByteA
                                .arg(QString::number(*port)));
 
     // Return TRUE if client exists
-    if (findClient(host,port,name) != NULL) return true;
+    // A cached connection learns the current appId of a peer which
+    // restarted on the same port, needed for the duplicate tie-break
+    IvyClient *existing = findClient(host,port,name);
+    if (existing != NULL) {
+        if (appId && existing->outgoing) existing->appId = *appId;
+        return true;
+    }
 
     // Create a new IvyClient, populate it, and
     // add it to QList<IvyClient*>
@@ -426,17 +826,15 @@ void IvyQt::addIvyClient(IvyClient *client)
     connect(client, SIGNAL(ivyClientBye(IvyClient*)),
             this, SLOT(onIvyClientBye(IvyClient*)));
 
-    connect(client, SIGNAL(ivyMessageReceived(IvyMessage*)),
-            this, SLOT(on_ivyMessageReceived(IvyMessage*)));
-
+    // Messages and statistics are delivered by direct calls
+    // from IvyClient rather than through signals
     connect(client, SIGNAL(ivyPongReceived(IvyClient*,qint16,qint64)),
             this, SLOT(onIvyClientPong(IvyClient*,qint16,qint64)));
 
-    connect(client, SIGNAL(ivyBusMessageStats(quint8,BusTrafficDirection,IvyClient*)),
-            this, SLOT(on_ivyBusMessageStats(quint8,BusTrafficDirection,IvyClient*)));
-
-    connect(client, SIGNAL(ivyBusTrafficStats(BusTrafficDirection,qint32,BusTrafficProtocol,IvyClient*)),
-            this, SLOT(on_ivyBusTrafficStats(BusTrafficDirection,qint32,BusTrafficProtocol,IvyClient*)));
+    client->peerId = nextPeerId++;
+    client->subscriptionPeer = remoteSubscriptions.addPeer(client);
+    client->setTransport(transportFor(client->name));
+    client->setLimits(limitsFor(client->name));
 
     clients.append(client);
 }
@@ -444,25 +842,271 @@ void IvyQt::addIvyClient(IvyClient *client)
 // Match intended message against connected clients subscriptions
 // Will send more than one message per client depending
 // on subscriptions
-void IvyQt::IvySendMsg(QByteArray *msg)
+void IvyQt::IvySendMsg(QByteArray *msg, int ttl)
+{
+    qint64 deadline = (ttl > 0) ? ivyTraceNow() + (qint64)ttl * 1000000 : 0;
+
+    if (lastValueCaching && !deadline) cacheLastValue(*msg);
+
+    emit ivyMessagesSent(publish(msg, deadline));
+}
+
+// Called from any thread
+void IvyQt::IvyPostMsg(const QByteArray &msg, int ttl)
+{
+    IvyPostedMsg *node = new IvyPostedMsg;
+    node->msg = msg;
+    node->deadline = (ttl > 0) ? ivyTraceNow() + (qint64)ttl * 1000000 : 0;
+    pushPostedMsg(node);
+
+    // Only the first post since the last drain queues a wakeup
+    if (postWakeupPending.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "drainPostedMessages", Qt::QueuedConnection);
+}
+
+void IvyQt::pushPostedMsg(IvyPostedMsg *node)
+{
+    node->next.store(0);
+    IvyPostedMsg *previous = postHead.fetchAndStoreOrdered(node);
+    previous->next.storeRelease(node);
+}
+
+// Bus thread only. Return 0 if the queue is empty, or while the
+// only waiting producer is between its swap and its link
+IvyPostedMsg *IvyQt::popPostedMsg()
+{
+    IvyPostedMsg *tail = postTail;
+    IvyPostedMsg *next = tail->next.loadAcquire();
+
+    if (tail == &postStub) {
+        if (!next) return 0;
+        postTail = next;
+        tail = next;
+        next = next->next.loadAcquire();
+    }
+
+    if (next) {
+        postTail = next;
+        return tail;
+    }
+
+    if (tail != postHead.loadAcquire()) return 0;
+
+    // Last node is only taken once the stub is queued behind it
+    pushPostedMsg(&postStub);
+    next = tail->next.loadAcquire();
+    if (!next) return 0;
+
+    postTail = next;
+    return tail;
+}
+
+// Publish posted messages, leaving any beyond postedBatchLimit to
+// a later event loop pass so sockets are serviced in between
+void IvyQt::drainPostedMessages()
+{
+    // Posts from here on queue another wakeup
+    postWakeupPending.fetchAndStoreOrdered(0);
+
+    quint32 msgCount = 0;
+    int count = 0;
+    IvyPostedMsg *node;
+    while (count < postedBatchLimit && (node = popPostedMsg())) {
+        if (lastValueCaching && !node->deadline) cacheLastValue(node->msg);
+        msgCount += publish(&node->msg, node->deadline);
+        delete node;
+        count++;
+    }
+
+    // Left by the limit, or by a producer caught mid push
+    if (postedMsgsWaiting() && postWakeupPending.testAndSetOrdered(0, 1))
+        QMetaObject::invokeMethod(this, "drainPostedMessages", Qt::QueuedConnection);
+
+    if (count) emit ivyMessagesSent(qMin(msgCount, (quint32)0xFFFF));
+}
+
+// Captures of the last match encoded as a Msg payload
+// Sliced straight from msg while it is ASCII up to the end of the
+// last capture, where character and byte offsets agree, so a large
+// capture is copied once. asciiLength caches the checked extent.
+static QByteArray capturePayload(const QRegExp &regexp, const QByteArray *msg, int *asciiLength)
+{
+    int captureCount = regexp.captureCount();
+    QVector<int> lengths(captureCount + 1);
+    int size = captureCount + 1;
+    int end = 0;
+    for (int i = 1; i <= captureCount; i++) {
+        lengths[i] = regexp.cap(i).size();
+        size += lengths.at(i);
+        if (regexp.pos(i) >= 0) end = qMax(end, regexp.pos(i) + lengths.at(i));
+    }
+
+    const char *data = msg->constData();
+    while (*asciiLength < end && (uchar)data[*asciiLength] < 0x80) (*asciiLength)++;
+
+    if (*asciiLength < end) {
+        QList<QByteArray> captures;
+        QList<QByteArray*> parameters;
+        for (int i = 0; i < captureCount; i++)
+            captures.append(regexp.cap(i+1).toUtf8());
+        for (int i = 0; i < captures.count(); i++)
+            parameters.append(&captures[i]);
+        return IvyMessage::encodePayload(parameters);
+    }
+
+    QByteArray payload;
+    payload.reserve(size);
+    for (int i = 1; i <= captureCount; i++) {
+        if (regexp.pos(i) >= 0) payload.append(data + regexp.pos(i), lengths.at(i));
+        payload.append(ARG_END);
+    }
+    payload.append('\n');
+
+    return payload;
+}
+
+// Return number of messages sent, a hub relaying a member message
+// passes the member as source so it is not sent back.
+// Each pattern is evaluated at most once per message, its encoded
+// payload is then shared by every row subscribed with it. Patterns
+// anchored on a literal the message does not start with are
+// rejected without running the QRegExp. The message is converted
+// to QString once, and only its first boundedMatchBytes for
+// patterns which cannot look further into a large message.
+quint16 IvyQt::publish(QByteArray *msg, qint64 deadline, IvyClient *source)
 {
     quint16 msgCount = 0;
+    bool timed = (matchProfiling || matchTimeBudget);
+    IvySubscriptionTable &table = remoteSubscriptions;
+    quint32 generation = table.nextGeneration();
+    QList<QByteArray> payloads;
+    QString text, head;
+    bool converted = false, headConverted = false;
+    int asciiLength = 0;
+
     // Find a match
     // /^ $/
-    for(int i = 0; i < clients.count(); i++) {
-        for(int j = 0; j < clients.at(i)->subscriptions.count(); j++) {
-            // qDebug() << qPrintable(QString("Checking %1 Pattern '%2' for '%3'").arg(clients.at(i)->name).arg(clients.at(i)->subscriptions.at(j)->pattern()).arg(QString(msg->data())));
-            QList<QByteArray*> *matches = clients.at(i)->subscriptions.at(j)->match(msg);
-            if (matches != NULL) {
-                // qDebug() << "Match!" << matches->count();
-                msgCount++;
-                clients.at(i)->sendTextMessage(clients.at(i)->subscriptions.at(j)->identifier,matches);
+    for (int row = 0; row < table.count(); row++) {
+        if (table.states.at(row) != IvySubscriptionTable::RowActive) continue;
+
+        int pattern = table.patterns.at(row);
+        if (table.patternFlags.at(pattern) & IvySubscriptionTable::PatternQuarantined) continue;
+
+        IvyClient *client = table.client(table.peers.at(row));
+        if (client == source) continue;
+
+        if (table.generations.at(pattern) != generation) {
+            table.generations[pattern] = generation;
+            table.results[pattern] = -1;
+
+            const QByteArray &prefix = table.prefixes.at(pattern);
+            if (!prefix.isEmpty() && !msg->startsWith(prefix)) continue;
+
+            // Conversion stops at the first NUL, as QString(QByteArray)
+            bool bounded = table.bounds.at(pattern) && msg->size() > IvySubscriptionTable::boundedMatchBytes;
+            if (bounded && !headConverted) {
+                const char *nul = (const char*)memchr(msg->constData(), 0, IvySubscriptionTable::boundedMatchBytes);
+                head = QString::fromUtf8(msg->constData(), nul ? nul - msg->constData() : IvySubscriptionTable::boundedMatchBytes);
+                headConverted = true;
             }
+            if (!bounded && !converted) {
+                text = QString(*msg);
+                converted = true;
+            }
+
+            QRegExp &regexp = table.regexps[pattern];
+            qint64 start = timed ? ivyTraceNow() : 0;
+            bool matched = (regexp.indexIn(bounded ? head : text) != -1);
+            table.evaluations[pattern]++;
+            if (timed) {
+                qint64 elapsed = ivyTraceNow() - start;
+                table.matchNanoseconds[pattern] += elapsed;
+                if (elapsed > table.worstMatchNanoseconds.at(pattern)) table.worstMatchNanoseconds[pattern] = elapsed;
+                if (matchTimeBudget && elapsed > matchTimeBudget)
+                    quarantinePattern(row, elapsed);
+            }
+            if (!matched) continue;
+
+            table.hits[pattern]++;
+            table.results[pattern] = payloads.count();
+            payloads.append(capturePayload(regexp, msg, &asciiLength));
+        }
+
+        int result = table.results.at(pattern);
+        if (result < 0) continue;
+
+        msgCount++;
+        client->sendTextPayload(table.identifiers.at(row),payloads.at(result),
+                                table.patternFlags.at(pattern) & IvySubscriptionTable::PatternConflated,deadline);
+    }
+
+    return msgCount;
+}
+
+// Single match took longer than the budget, most likely nested
+// quantifiers backtracking. Stop evaluating the pattern rather
+// than stall every later IvySendMsg.
+void IvyQt::quarantinePattern(int row, qint64 nanoseconds)
+{
+    IvySubscriptionTable &table = remoteSubscriptions;
+    int pattern = table.patterns.at(row);
+    IvyClient *client = table.client(table.peers.at(row));
+
+    table.patternFlags[pattern] |= IvySubscriptionTable::PatternQuarantined;
+    statsQuarantinedSubscriptions++;
+
+    logMessage(QString("Quarantined pattern %1 '%2' from %3 after %4 us match")
+               .arg(QString::number(table.identifiers.at(row)))
+               .arg(table.regexps.at(pattern).pattern())
+               .arg(client->name)
+               .arg(QString::number(nanoseconds / 1000)),1);
+
+    emit ivySubscriptionQuarantined(client, table.identifiers.at(row), table.regexps.at(pattern).pattern(), nanoseconds);
+}
+
+static bool costLessThan(const IvySubscriptionCost &a, const IvySubscriptionCost &b)
+{
+    if (a.totalNanoseconds != b.totalNanoseconds) return a.totalNanoseconds > b.totalNanoseconds;
+    return a.evaluations > b.evaluations;
+}
+
+// Most expensive remote patterns by cumulative match time,
+// or by evaluation count while timing is disabled
+QList<IvySubscriptionCost> IvyQt::subscriptionCostReport(int count)
+{
+    const IvySubscriptionTable &table = remoteSubscriptions;
+    QList<IvySubscriptionCost> report;
+    QHash<int, int> entries; // report index by pattern
+
+    for (int row = 0; row < table.count(); row++) {
+        if (table.states.at(row) == IvySubscriptionTable::RowFree) continue;
+
+        int pattern = table.patterns.at(row);
+        QHash<int, int>::const_iterator entry = entries.constFind(pattern);
+        if (entry != entries.constEnd()) {
+            report[entry.value()].subscribers++;
+            continue;
         }
+
+        IvySubscriptionCost cost;
+        cost.client = table.client(table.peers.at(row));
+        cost.peer = cost.client->name;
+        cost.identifier = table.identifiers.at(row);
+        cost.pattern = table.regexps.at(pattern).pattern();
+        cost.subscribers = 1;
+        cost.evaluations = table.evaluations.at(pattern);
+        cost.hits = table.hits.at(pattern);
+        cost.totalNanoseconds = table.matchNanoseconds.at(pattern);
+        cost.worstNanoseconds = table.worstMatchNanoseconds.at(pattern);
+        cost.quarantined = (table.patternFlags.at(pattern) & IvySubscriptionTable::PatternQuarantined);
+        entries.insert(pattern, report.count());
+        report.append(cost);
     }
 
-    emit ivyMessagesSent(msgCount);
+    qSort(report.begin(), report.end(), costLessThan);
+    if (count > 0 && report.count() > count) report = report.mid(0, count);
 
+    return report;
 }
 
 //// Subscribe local IvyQt client
@@ -529,10 +1173,61 @@ void IvyQt::sendSubscriptions()
         clients.at(i)->sendSubscriptions();
 }
 
+// Encode local subscriptions as AddRegexp frames followed by
+// EndRegexp. Rebuilt only after bindings change so joining a bus
+// costs one write per peer regardless of the number of bindings.
+// A hub also advertises its relays, and gives members the catch-all
+const QByteArray &IvyQt::encodedSubscriptions(IvyClient *client)
+{
+    if (client && client->member) return memberSubscriptionFrames;
+
+    if (!subscriptionFramesValid) {
+        subscriptionFrames.clear();
+        for (int i = 0; i < subscriptions.count(); i++) {
+            QByteArray data = subscriptions.at(i)->pattern().toUtf8();
+            subscriptionFrames.append(IvyMessage::encode(AddRegexp,subscriptions.at(i)->identifier,&data));
+        }
+        QMap<quint16, IvyRelay*>::const_iterator it;
+        for (it = relays.constBegin(); it != relays.constEnd(); ++it) {
+            QByteArray data = it.value()->pattern.toUtf8();
+            subscriptionFrames.append(IvyMessage::encode(AddRegexp,it.key(),&data));
+        }
+        subscriptionFrames.append(IvyMessage::encode(EndRegexp,0));
+        subscriptionFramesValid = true;
+    }
+
+    return subscriptionFrames;
+}
+
+// Number of AddRegexp frames in encodedSubscriptions()
+int IvyQt::advertisedSubscriptionCount(IvyClient *client)
+{
+    if (client && client->member) return 1;
+    return subscriptions.count() + relays.count();
+}
+
 void IvyQt::onIvyClientReady(IvyClient *ivyClient)
 {
+    clientsByName.insert(ivyClient->name, ivyClient);
+
+    rememberPeer(ivyClient);
+
+    if (recorder) recorder->recordPeer(ivyClient->peerId, ivyClient->name, ivyClient->appId);
+
     emit ivyClientReady(ivyClient);
-    logMessage(QString("IvyClient %1 READY").arg(ivyClient->name),1);
+    logMessage(QString("IvyClient %1 READY in %2 us").arg(ivyClient->name).arg(QString::number(ivyClient->timeToReady)),1);
+
+    // Whole bus is ready once every known peer has completed
+    // its handshake, reported once per IvyStart
+    if (busTimeToReady >= 0 || !busJoinElapsedTimer.isValid()) return;
+
+    for (int i = 0; i < clients.count(); i++)
+        if (!clients.at(i)->isReady()) return;
+
+    busTimeToReady = busJoinElapsedTimer.nsecsElapsed() / 1000;
+    logMessage(QString("Ivy Bus READY with %1 peers in %2 us").arg(QString::number(clients.count())).arg(QString::number(busTimeToReady)),1);
+
+    emit ivyBusReady(busTimeToReady);
 }
 
 // Ivy Client is disconnected
@@ -547,15 +1242,22 @@ void IvyQt::onIvyClientBye(IvyClient *ivyClient)
             this, SLOT(onIvyClientReady(IvyClient*)));
     disconnect(ivyClient, SIGNAL(ivyClientBye(IvyClient*)),
             this, SLOT(onIvyClientBye(IvyClient*)));
-    disconnect(ivyClient, SIGNAL(ivyMessageReceived(IvyMessage*)),
-            this, SLOT(on_ivyMessageReceived(IvyMessage*)));
 
     logMessage(QString("IvyClient %1 BYE").arg(ivyClient->name),1);
 
     emit ivyClientBye(ivyClient);
 
+    if (ivyClient->member) removeRelayTargets(ivyClient);
+    removeRemoteSubscriptions(ivyClient);
+
     // Clean up client
     clients.removeAll(ivyClient);
+    if (clientsByName.value(ivyClient->name) == ivyClient)
+        clientsByName.remove(ivyClient->name);
+
+    // Its messages are children of the client, pending
+    // batches must be delivered before it is deleted
+    flushBatches();
 
     // TODO: too dangerous to delete as-is at this point
     // need a more elegant solution
@@ -565,13 +1267,40 @@ void IvyQt::onIvyClientBye(IvyClient *ivyClient)
 // void IvyQt::on_ivyMessageReceived(quint16 identifier, QList<QByteArray> *args, IvyClient *client)
 void IvyQt::on_ivyMessageReceived(IvyMessage *ivymsg)
 {
+    bool batched = false;
+
+    // Hub traffic is relayed rather than delivered locally
+    if (role == HubRole && (ivymsg->type == Msg) && ivymsg->isValid() && ivymsg->client) {
+        if (ivymsg->client->member && ivymsg->identifier == hubCatchAllIdentifier) {
+            relayMemberMessage(ivymsg);
+            return;
+        }
+        IvyRelay *relay = ivymsg->client->member ? 0 : relays.value(ivymsg->identifier, 0);
+        if (relay) {
+            relayMeshMessage(ivymsg, relay);
+            return;
+        }
+    }
 
     if ((ivymsg->type == Msg) && ivymsg->isValid())
     {
         Subscription* subscription = subscriptionByIdentifier(ivymsg->identifier);
+        if (ivymsg->trace[TraceRead]) ivymsg->trace[TraceMatched] = ivyTraceNow();
         // Invoke slot if designated for this subscription
-        if (!subscription->slotMember.isEmpty() && subscription->slotReceiver)
+        // Subscription may have been unbound while the message was in flight
+        if (subscription && !subscription->slotMember.isEmpty() && subscription->slotReceiver)
         {
+            // slot(QVector<IvyMessage*>)
+            // Held until the end of the socket read or batch window
+            if (subscription->isBatched()) {
+                if (subscription->pendingBatch.isEmpty()) {
+                    pendingBatchSubscriptions.append(subscription);
+                    if (batchWindow > 0 && !batchTimer.isActive()) batchTimer.start(batchWindow);
+                }
+                subscription->pendingBatch.append(ivymsg);
+                batched = true;
+            }
+
             // qRegisterMetaType<QList<QByteArray>*>("QList<QByteArray>*");
             // slot(IvyMessage*)
             if (subscription->slotParameters == "IvyMessage*") {
@@ -588,6 +1317,11 @@ void IvyQt::on_ivyMessageReceived(IvyMessage *ivymsg)
 
     emit ivyMessageReceived(ivymsg);
 
+    if (ivymsg->trace[TraceMatched] && !batched) {
+        ivymsg->trace[TraceDispatched] = ivyTraceNow();
+        if (ivymsg->client) ivymsg->client->traceMessage(ivymsg);
+    }
+
 //    QString prms;
 //    for (int i = 0; i < args->count(); i++) {
 //        prms.append(args->at(i));
@@ -598,6 +1332,399 @@ void IvyQt::on_ivyMessageReceived(IvyMessage *ivymsg)
 
 }
 
+void IvyQt::on_ivyDirectMessageReceived(IvyMessage *ivymsg)
+{
+    emit ivyDirectMessageReceived(ivymsg);
+}
+
+// Send a point to point message to a single peer
+// Bypasses subscription matching entirely
+// Return TRUE if error
+int IvyQt::IvySendDirectMsg(IvyClient *client, quint32 identifier, const QByteArray &payload)
+{
+    if (!client || !client->isReady()) return true;
+
+    client->sendDirectMessage(identifier, payload);
+
+    return false;
+}
+
+// Peer is located by agent name in constant time
+// If several peers share a name the most recently ready one is used
+int IvyQt::IvySendDirectMsg(const QString &peerName, quint32 identifier, const QByteArray &payload)
+{
+    return IvySendDirectMsg(clientsByName.value(peerName, 0), identifier, payload);
+}
+
+// Return TRUE if row can never match a message starting with one
+// of the filter heads
+bool IvyQt::isFilteredBinding(int row)
+{
+    if (_filterHeads.isEmpty() || role == HubRole) return false;
+
+    const IvySubscriptionTable &table = remoteSubscriptions;
+
+    // UTF-8 keeps prefixes of text prefixes of its bytes
+    const QByteArray &literal = table.prefixes.at(table.patterns.at(row));
+    if (literal.isEmpty()) return false;
+
+    for (int i = 0; i < _filterHeads.count(); i++) {
+        QByteArray head = _filterHeads.at(i).toUtf8();
+        if (head.startsWith(literal) || literal.startsWith(head)) return false;
+    }
+
+    return true;
+}
+
+// As isFilteredBinding, reporting a row which was not filtered
+bool IvyQt::filterBinding(int row)
+{
+    if (!isFilteredBinding(row)) return false;
+
+    const IvySubscriptionTable &table = remoteSubscriptions;
+    statsFilteredBindings++;
+    emit ivyBindEvent(table.client(table.peers.at(row)), table.identifiers.at(row),
+                      table.regexps.at(table.patterns.at(row)).pattern(), IvyFilterBind);
+
+    return true;
+}
+
+// Re-evaluate bindings already received against the new heads
+// Only rows changing from active to filtered are reported
+void IvyQt::IvySetFilter(const QStringList &heads)
+{
+    _filterHeads = heads;
+
+    int filtered = 0;
+    IvySubscriptionTable &table = remoteSubscriptions;
+    for (int row = 0; row < table.count(); row++) {
+        quint8 state = table.states.at(row);
+        if (state == IvySubscriptionTable::RowFiltered) {
+            if (!isFilteredBinding(row)) table.states[row] = IvySubscriptionTable::RowActive;
+        } else if (state == IvySubscriptionTable::RowActive && filterBinding(row)) {
+            table.states[row] = IvySubscriptionTable::RowFiltered;
+            filtered++;
+        }
+    }
+
+    logMessage(QString("Filter set to %1 heads, %2 bindings filtered")
+               .arg(QString::number(heads.count()))
+               .arg(QString::number(filtered)),1);
+}
+
+// Subscribe a peer's identifier to pattern, sharing the compiled
+// pattern of any other row with the same text
+bool IvyQt::addRemoteSubscription(IvyClient *client, quint16 identifier, const QString &pattern)
+{
+    if (client->subscriptionPeer < 0) return false;
+
+    bool replaced = removeRemoteSubscription(client, identifier);
+
+    IvySubscriptionTable &table = remoteSubscriptions;
+    int handle = table.acquirePattern(pattern);
+    if (table.references.at(handle) == 1) {
+        if (conflatedPatterns.contains(pattern))
+            table.patternFlags[handle] |= IvySubscriptionTable::PatternConflated;
+        if (!compilePattern(handle))
+            table.patternFlags[handle] |= IvySubscriptionTable::PatternReady;
+    }
+
+    client->subscriptionCount++;
+    client->subscriptionBytes += pattern.size() * sizeof(QChar);
+
+    if (!(table.patternFlags.at(handle) & IvySubscriptionTable::PatternReady)) {
+        int row = table.insert(client->subscriptionPeer, identifier, handle, IvySubscriptionTable::RowPending);
+        table.pendingRows[handle].append(row);
+        client->pendingSubscriptionCount++;
+        return replaced;
+    }
+
+    int row = table.insert(client->subscriptionPeer, identifier, handle, IvySubscriptionTable::RowActive);
+    if (filterBinding(row)) table.states[row] = IvySubscriptionTable::RowFiltered;
+    else replayLastValues(row);
+
+    return replaced;
+}
+
+bool IvyQt::removeRemoteSubscription(IvyClient *client, quint16 identifier)
+{
+    IvySubscriptionTable &table = remoteSubscriptions;
+    int row = table.find(client->subscriptionPeer, identifier);
+    if (row < 0) return false;
+
+    if (table.states.at(row) == IvySubscriptionTable::RowPending)
+        client->pendingSubscriptionCount--;
+    client->subscriptionCount--;
+    client->subscriptionBytes -= table.regexps.at(table.patterns.at(row)).pattern().size() * sizeof(QChar);
+    table.remove(row);
+
+    return true;
+}
+
+// Client is leaving, its rows and peer index are released
+void IvyQt::removeRemoteSubscriptions(IvyClient *client)
+{
+    remoteSubscriptions.removePeer(client->subscriptionPeer);
+    client->subscriptionPeer = -1;
+    client->pendingSubscriptionCount = 0;
+    client->subscriptionCount = 0;
+    client->subscriptionBytes = 0;
+}
+
+// Return TRUE if compilation was queued, the pattern's rows are
+// then activated by onSubscriptionCompiled
+bool IvyQt::compilePattern(int pattern)
+{
+    if (!backgroundCompilation) return false;
+
+    quint32 job = nextCompileJob++;
+    if (!job) job = nextCompileJob++;
+    remoteSubscriptions.compileJobs[pattern] = job;
+    compileJobs.insert(job, pattern);
+    compilePool.start(new SubscriptionCompiler(this, job, remoteSubscriptions.regexps.at(pattern).pattern()));
+
+    return true;
+}
+
+// Every row of the pattern may have gone while compiling, and
+// its handle been reused by another job
+void IvyQt::onSubscriptionCompiled(quint32 job, QRegExp regexp)
+{
+    IvySubscriptionTable &table = remoteSubscriptions;
+    int pattern = compileJobs.take(job);
+    if (pattern >= table.patternCount() || table.compileJobs.at(pattern) != job) return;
+
+    table.regexps[pattern] = regexp;
+    table.compileJobs[pattern] = 0;
+    table.patternFlags[pattern] |= IvySubscriptionTable::PatternReady;
+
+    QVector<int> rows = table.pendingRows.take(pattern);
+    for (int i = 0; i < rows.count(); i++) {
+        int row = rows.at(i);
+        if (table.states.at(row) != IvySubscriptionTable::RowPending || table.patterns.at(row) != pattern) continue;
+
+        table.states[row] = filterBinding(row) ? IvySubscriptionTable::RowFiltered : IvySubscriptionTable::RowActive;
+        if (table.states.at(row) == IvySubscriptionTable::RowActive) replayLastValues(row);
+        table.client(table.peers.at(row))->subscriptionCompiled();
+    }
+}
+
+void IvyQt::setTransport(IvyTransport transport)
+{
+    defaultTransport = transport;
+
+    for (int i = 0; i < clients.count(); i++)
+        clients.at(i)->setTransport(transportFor(clients.at(i)->name));
+}
+
+void IvyQt::setPeerTransport(const QString &peerName, IvyTransport transport)
+{
+    peerTransports.insert(peerName, transport);
+
+    for (int i = 0; i < clients.count(); i++)
+        if (clients.at(i)->name == peerName) clients.at(i)->setTransport(transport);
+}
+
+// Low latency disables Nagle so small control frames leave at once
+// and queues bulk messages early to keep them off the wire ahead of
+// control traffic. High throughput lets Nagle coalesce small frames,
+// enlarges socket buffers and lets more bulk data reach the socket.
+IvyTransportProfile IvyQt::transportProfile(IvyTransport transport)
+{
+    IvyTransportProfile profile;
+    profile.lowDelay = false;
+    profile.keepAlive = false;
+    profile.sendBufferSize = 0;
+    profile.receiveBufferSize = 0;
+    profile.congestionThreshold = 0;
+
+    switch (transport) {
+
+    case LowLatencyTransport:
+        profile.lowDelay = true;
+        profile.keepAlive = true;
+        profile.congestionThreshold = 16 * 1024;
+        break;
+
+    case HighThroughputTransport:
+        profile.keepAlive = true;
+        profile.sendBufferSize = 1024 * 1024;
+        profile.receiveBufferSize = 1024 * 1024;
+        profile.congestionThreshold = 1024 * 1024;
+        break;
+
+    case DefaultTransport:
+        break;
+    }
+
+    return profile;
+}
+
+const char *IvyQt::transportName(IvyTransport transport)
+{
+    switch (transport) {
+    case LowLatencyTransport: return "low-latency";
+    case HighThroughputTransport: return "high-throughput";
+    case DefaultTransport: break;
+    }
+    return "default";
+}
+
+void IvyQt::setPeerLimits(const IvyPeerLimits &limits)
+{
+    defaultPeerLimits = limits;
+
+    for (int i = 0; i < clients.count(); i++)
+        clients.at(i)->setLimits(limitsFor(clients.at(i)->name));
+}
+
+void IvyQt::setPeerLimits(const QString &peerName, const IvyPeerLimits &limits)
+{
+    peerLimits.insert(peerName, limits);
+
+    for (int i = 0; i < clients.count(); i++)
+        if (clients.at(i)->name == peerName) clients.at(i)->setLimits(limits);
+}
+
+IvyPeerLimits IvyQt::unlimited()
+{
+    IvyPeerLimits limits;
+    limits.maxFrameSize = 0;
+    limits.maxReceiveBuffer = 0;
+    limits.maxSubscriptions = 0;
+    limits.maxPatternLength = 0;
+    limits.maxOutboundBytes = 0;
+    limits.maxRetainedBytes = 0;
+    limits.disconnect = false;
+
+    return limits;
+}
+
+const char *IvyQt::limitName(IvyPeerLimit limit)
+{
+    switch (limit) {
+    case FrameSizeLimit: return "frame size";
+    case SubscriptionLimit: return "subscription";
+    case PatternLengthLimit: return "pattern length";
+    case OutboundBytesLimit: return "outbound bytes";
+    case RetainedBytesLimit: return "retained bytes";
+    }
+    return "unknown";
+}
+
+// Messages for remote subscriptions with exactly this pattern are
+// conflated: a congested peer only receives the latest one
+void IvyQt::setConflation(const QString &pattern, bool enabled)
+{
+    if (enabled) conflatedPatterns.insert(pattern);
+    else conflatedPatterns.remove(pattern);
+
+    // Apply to subscriptions already received
+    int handle = remoteSubscriptions.findPattern(pattern);
+    if (handle < 0) return;
+    if (enabled) remoteSubscriptions.patternFlags[handle] |= IvySubscriptionTable::PatternConflated;
+    else remoteSubscriptions.patternFlags[handle] &= ~IvySubscriptionTable::PatternConflated;
+}
+
+// Disabling empties the cache, changing the key keeps entries
+// cached under the previous one
+void IvyQt::setLastValueCache(bool enabled, const QString &keyPattern, int maxEntries)
+{
+    lastValueCaching = enabled;
+    lastValueKey = QRegExp(keyPattern, Qt::CaseSensitive, QRegExp::RegExp);
+    maxLastValues = maxEntries;
+
+    if (!enabled) lastValues.clear();
+}
+
+// Key of msg in the last-value cache, empty if it has none
+QByteArray IvyQt::lastValueKeyOf(const QByteArray &msg)
+{
+    if (lastValueKey.isEmpty()) {
+        int space = msg.indexOf(' ');
+        return (space < 0) ? QByteArray() : msg.left(space);
+    }
+
+    if (lastValueKey.indexIn(QString(msg)) == -1) return QByteArray();
+    return lastValueKey.cap(lastValueKey.captureCount() ? 1 : 0).toUtf8();
+}
+
+void IvyQt::cacheLastValue(const QByteArray &msg)
+{
+    QByteArray key = lastValueKeyOf(msg);
+    if (key.isEmpty()) return;
+
+    if (maxLastValues && lastValues.count() >= maxLastValues && !lastValues.contains(key)) {
+        statsLastValuesDropped++;
+        return;
+    }
+
+    lastValues.insert(key, msg);
+}
+
+// Send a newly active row the cached messages its pattern matches,
+// in key order
+void IvyQt::replayLastValues(int row)
+{
+    if (lastValues.isEmpty()) return;
+
+    IvySubscriptionTable &table = remoteSubscriptions;
+    int pattern = table.patterns.at(row);
+    if (table.patternFlags.at(pattern) & IvySubscriptionTable::PatternQuarantined) return;
+
+    IvyClient *client = table.client(table.peers.at(row));
+    const QByteArray &prefix = table.prefixes.at(pattern);
+    QRegExp &regexp = table.regexps[pattern];
+    bool conflated = table.patternFlags.at(pattern) & IvySubscriptionTable::PatternConflated;
+
+    QMap<QByteArray, QByteArray>::const_iterator it;
+    for (it = lastValues.constBegin(); it != lastValues.constEnd(); ++it) {
+        const QByteArray &msg = it.value();
+        if (!prefix.isEmpty() && !msg.startsWith(prefix)) continue;
+        if (regexp.indexIn(QString(msg)) == -1) continue;
+
+        int asciiLength = 0;
+        client->sendTextPayload(table.identifiers.at(row), capturePayload(regexp, &msg, &asciiLength), conflated);
+        statsLastValueReplays++;
+    }
+}
+
+// Deliver pending batches, one slot invocation per subscription
+// Called by IvyClient once a socket read has been processed, or
+// by the batch timer when a batch window is set
+void IvyQt::flushBatches()
+{
+    if (pendingBatchSubscriptions.isEmpty()) return;
+
+    batchTimer.stop();
+
+    qRegisterMetaType<QVector<IvyMessage*> >("QVector<IvyMessage*>");
+
+    // Subscriptions may be unbound by the receiving slot
+    QList<Subscription*> pending = pendingBatchSubscriptions;
+    pendingBatchSubscriptions.clear();
+
+    for (int i = 0; i < pending.count(); i++) {
+        Subscription *subscription = pending.at(i);
+        if (!subscriptions.contains(subscription)) continue;
+
+        QVector<IvyMessage*> batch = subscription->pendingBatch;
+        subscription->pendingBatch.clear();
+
+        QMetaObject::invokeMethod(subscription->slotReceiver, subscription->slotMember.constData(), Qt::AutoConnection, Q_ARG(QVector<IvyMessage*>, batch));
+
+        if (latencyTracing) {
+            qint64 now = ivyTraceNow();
+            for (int j = 0; j < batch.count(); j++) {
+                IvyMessage *ivymsg = batch.at(j);
+                if (!ivymsg->trace[TraceMatched]) continue;
+                ivymsg->trace[TraceDispatched] = now;
+                if (ivymsg->client) ivymsg->client->traceMessage(ivymsg);
+            }
+        }
+    }
+}
+
 // Client has received a PONG response to a PING
 void IvyQt::onIvyClientPong(IvyClient *client, qint16 id, qint64 roundtrip)
 {
@@ -650,3 +1777,291 @@ void IvyQt::on_ivyBusMessageStats(quint8 type, BusTrafficDirection direction, Iv
     emit ivyBusMessageStats(type,direction,client);
 }
 
+
+// Write a relay change to every mesh peer already past its handshake
+void IvyQt::propagateToMesh(const QByteArray &frame, MsgType type)
+{
+    subscriptionFramesValid = false;
+
+    for (int i = 0; i < clients.count(); i++) {
+        IvyClient *client = clients.at(i);
+        if (!client->subscriptionsSent || client->member) continue;
+        if (client->writeFrames(frame)) continue;
+        client->logMessageStats(type,Out);
+    }
+}
+
+// Member subscription, advertised to the mesh the first time
+// any member subscribes to its pattern
+void IvyQt::addRelayTarget(IvyClient *member, quint16 identifier, const QString &pattern)
+{
+    if (role != HubRole) return;
+
+    IvyRelay *relay = relaysByPattern.value(pattern, 0);
+    if (!relay) {
+        quint16 relayIdentifier = allocateRelayIdentifier();
+        if (!relayIdentifier) {
+            logMessage(QString("No relay identifier left for %1").arg(pattern),1);
+            return;
+        }
+
+        relay = new IvyRelay;
+        relay->pattern = pattern;
+        relay->identifier = relayIdentifier;
+        relays.insert(relay->identifier, relay);
+        relaysByPattern.insert(pattern, relay);
+
+        QByteArray data = pattern.toUtf8();
+        propagateToMesh(IvyMessage::encode(AddRegexp,relay->identifier,&data), AddRegexp);
+    }
+
+    relay->targets.append(qMakePair(member, identifier));
+}
+
+// Identifiers of withdrawn relays are reused first, so churn never
+// reaches hubCatchAllIdentifier nor wraps into local identifiers.
+// Return 0 once every identifier from hubRelayIdentifierBase is used.
+quint16 IvyQt::allocateRelayIdentifier()
+{
+    while (!freeRelayIdentifiers.isEmpty()) {
+        quint16 identifier = freeRelayIdentifiers.takeLast();
+        if (!relays.contains(identifier)) return identifier;
+    }
+
+    while (nextRelayIdentifier < hubCatchAllIdentifier) {
+        quint16 identifier = nextRelayIdentifier++;
+        if (!relays.contains(identifier)) return identifier;
+    }
+
+    return 0;
+}
+
+// Relay is withdrawn from the mesh with its last target
+void IvyQt::removeRelayTarget(IvyClient *member, quint16 identifier)
+{
+    QMap<quint16, IvyRelay*>::iterator it;
+    for (it = relays.begin(); it != relays.end(); ++it) {
+        IvyRelay *relay = it.value();
+        if (!relay->targets.removeOne(qMakePair(member, identifier))) continue;
+
+        if (relay->targets.isEmpty()) {
+            propagateToMesh(IvyMessage::encode(DelRegexp,relay->identifier), DelRegexp);
+            relaysByPattern.remove(relay->pattern);
+            freeRelayIdentifiers.append(relay->identifier);
+            relays.erase(it);
+            delete relay;
+        }
+        return;
+    }
+}
+
+void IvyQt::removeRelayTargets(IvyClient *member)
+{
+    QList<quint16> identifiers;
+    QMap<quint16, IvyRelay*>::const_iterator it;
+    for (it = relays.constBegin(); it != relays.constEnd(); ++it)
+        for (int i = 0; i < it.value()->targets.count(); i++)
+            if (it.value()->targets.at(i).first == member)
+                identifiers.append(it.value()->targets.at(i).second);
+
+    for (int i = 0; i < identifiers.count(); i++)
+        removeRelayTarget(member, identifiers.at(i));
+}
+
+// Message published by a member through the catch-all, its only
+// capture is the original message. Match it against every other
+// peer, members and mesh alike, and against local bindings.
+void IvyQt::relayMemberMessage(IvyMessage *ivymsg)
+{
+    if (ivymsg->parameters.isEmpty()) return;
+
+    QByteArray msg = ivymsg->parameters.at(0);
+
+    statsHubMemberMessages++;
+    publish(&msg, 0, ivymsg->client);
+    deliverLocally(&msg, ivymsg->client);
+}
+
+// Mesh peer has already matched the relay pattern, pass the
+// captures on unchanged to each member subscribed to it
+void IvyQt::relayMeshMessage(IvyMessage *ivymsg, IvyRelay *relay)
+{
+    QList<QByteArray*> captures;
+    for (int i = 0; i < ivymsg->parameters.count(); i++)
+        captures.append(&ivymsg->parameters[i]);
+    QByteArray payload = IvyMessage::encodePayload(captures);
+
+    for (int i = 0; i < relay->targets.count(); i++) {
+        IvyClient *member = relay->targets.at(i).first;
+        int row = remoteSubscriptions.find(member->subscriptionPeer, relay->targets.at(i).second);
+        member->sendTextPayload(relay->targets.at(i).second, payload, row >= 0 && remoteSubscriptions.isConflated(row));
+    }
+
+    statsHubRelayedMessages++;
+}
+
+// Dispatch a relayed member message to local bindings as if the
+// member had matched them itself
+void IvyQt::deliverLocally(QByteArray *msg, IvyClient *source)
+{
+    for (int i = 0; i < subscriptions.count(); i++) {
+        Subscription *subscription = subscriptions.at(i);
+        QList<QByteArray*> *matches = subscription->match(msg);
+        if (matches == NULL) continue;
+
+        QByteArray data;
+        for (int j = 0; j < matches->count(); j++) {
+            data.append(*matches->at(j));
+            data.append(0x03);
+        }
+        qDeleteAll(*matches);
+        delete matches;
+
+        QByteArray *frame = new QByteArray(IvyMessage::encode(Msg,subscription->identifier,&data));
+        frame->chop(1); // EOL
+
+        IvyMessage *ivymsg = new IvyMessage(frame,source);
+        source->retainMessage(ivymsg);
+        on_ivyMessageReceived(ivymsg);
+    }
+}
+
+// Enable the peer cache, loading peers saved by an earlier run
+void IvyQt::setPeerCache(const QString &fileName)
+{
+    peerCacheFileName = fileName;
+    loadPeerCache();
+}
+
+QString IvyQt::peerCacheKey(const QHostAddress &address, quint16 port)
+{
+    return QString("%1:%2").arg(address.toString()).arg(QString::number(port));
+}
+
+// One peer per line, name last as it may contain spaces
+// Example: 1384811808974 172.23.2.10 59399 16961:1384811808974:59399 IvyExplorer
+void IvyQt::loadPeerCache()
+{
+    peerCache.clear();
+
+    QFile file(peerCacheFileName);
+    if (!file.open(QIODevice::ReadOnly)) return;
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+
+    while (!file.atEnd()) {
+        QByteArray line = file.readLine().trimmed();
+        QList<QByteArray> fields = line.split(' ');
+        if (fields.count() < 5) continue;
+
+        IvyCachedPeer peer;
+        peer.lastSeen = fields.at(0).toLongLong();
+        peer.address = QHostAddress(QString(fields.at(1)));
+        peer.port = fields.at(2).toUInt();
+        if (fields.at(3) != "-") peer.appId = fields.at(3);
+        peer.name = QString::fromUtf8(line.mid(fields.at(0).size() + fields.at(1).size() + fields.at(2).size() + fields.at(3).size() + 4));
+
+        if (peer.address.isNull() || !peer.port) continue;
+        if (now - peer.lastSeen > peerCacheMaxAge) continue;
+
+        peerCache.insert(peerCacheKey(peer.address, peer.port), peer);
+    }
+
+    logMessage(QString("Loaded %1 peers from %2").arg(QString::number(peerCache.count())).arg(peerCacheFileName),1);
+}
+
+// Written at most once per peerCacheSaveDelay while peers join
+void IvyQt::savePeerCache()
+{
+    if (peerCacheFileName.isEmpty()) return;
+
+    QSaveFile file(peerCacheFileName);
+    if (!file.open(QIODevice::WriteOnly)) return;
+
+    QHash<QString, IvyCachedPeer>::const_iterator it;
+    for (it = peerCache.constBegin(); it != peerCache.constEnd(); ++it) {
+        const IvyCachedPeer &peer = it.value();
+        QByteArray line = QString("%1 %2 %3 ")
+                .arg(QString::number(peer.lastSeen))
+                .arg(peer.address.toString())
+                .arg(QString::number(peer.port)).toUtf8();
+        line.append(peer.appId.isEmpty() ? QByteArray("-") : peer.appId);
+        line.append(' ');
+        line.append(peer.name.toUtf8());
+        line.append('\n');
+        file.write(line);
+    }
+
+    file.commit();
+}
+
+// Connections are opened in parallel with UDP discovery, which
+// finds these clients already present when announcements arrive
+void IvyQt::connectCachedPeers()
+{
+    if (peerCacheFileName.isEmpty()) return;
+
+    QHash<QString, IvyCachedPeer>::const_iterator it;
+    for (it = peerCache.constBegin(); it != peerCache.constEnd(); ++it) {
+        IvyCachedPeer peer = it.value();
+        if (peer.port == localTcpPort && peer.name == agentName) continue;
+        if (findClient(&peer.address, &peer.port, &peer.name)) continue;
+
+        QByteArray *appId = peer.appId.isEmpty() ? 0 : &peer.appId;
+        IvyClient *client = new IvyClient(this,&peer.address,&peer.port,&peer.name,appId,this);
+        client->cached = true;
+        addIvyClient(client);
+    }
+
+    if (peerCache.count())
+        logMessage(QString("Connecting to %1 cached peers").arg(QString::number(peerCache.count())),1);
+}
+
+// Return TRUE if the peer answering on a cached address is the one
+// which was cached, otherwise the connection is dropped
+bool IvyQt::confirmCachedPeer(IvyClient *client, const QString &name, quint16 port)
+{
+    client->cached = false;
+
+    if (name == client->name && port == client->port) return true;
+
+    logMessage(QString("Cached peer %1 at %2:%3 is now %4")
+               .arg(client->name)
+               .arg(client->hostAddress->toString())
+               .arg(QString::number(client->port))
+               .arg(name),1);
+
+    peerCache.remove(peerCacheKey(*client->hostAddress, client->port));
+    peerCacheSaveTimer.start(peerCacheSaveDelay);
+    dropClient(client);
+
+    return false;
+}
+
+void IvyQt::forgetCachedPeer(IvyClient *client)
+{
+    logMessage(QString("Cached peer %1 at %2:%3 unreachable")
+               .arg(client->name)
+               .arg(client->hostAddress->toString())
+               .arg(QString::number(client->port)),1);
+
+    peerCache.remove(peerCacheKey(*client->hostAddress, client->port));
+    peerCacheSaveTimer.start(peerCacheSaveDelay);
+    dropClient(client);
+}
+
+// Hub members cannot be connected to directly
+void IvyQt::rememberPeer(IvyClient *client)
+{
+    if (peerCacheFileName.isEmpty() || client->member || !client->port) return;
+
+    IvyCachedPeer peer;
+    peer.address = *client->hostAddress;
+    peer.port = client->port;
+    peer.appId = client->appId;
+    peer.name = client->name;
+    peer.lastSeen = QDateTime::currentMSecsSinceEpoch();
+    peerCache.insert(peerCacheKey(peer.address, peer.port), peer);
+
+    if (!peerCacheSaveTimer.isActive()) peerCacheSaveTimer.start(peerCacheSaveDelay);
+}
@@ -7,13 +7,22 @@
 #include <QTcpSocket> // may not need if using clients!
 
 #include <QList>
+#include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QSet>
 #include <QHostAddress>
 
 #include <QRegExp>
 #include <QStringList>
+#include <QtAlgorithms>
 
 #include <QTimer>
 #include <QDateTime>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <QAtomicInt>
+#include <QAtomicPointer>
 
 typedef enum {
     Bye = 0,
@@ -53,24 +62,106 @@ typedef enum {
     Either = 2
 } BusTrafficProtocol;
 
+typedef enum {
+    DefaultTransport = 0,       // operating system socket defaults
+    LowLatencyTransport = 1,    // no Nagle delay, bulk queued early
+    HighThroughputTransport = 2 // Nagle batching, large buffers
+} IvyTransport;
+
+// Socket tuning applied to peer connections
+typedef struct {
+    bool lowDelay; // TCP_NODELAY
+    bool keepAlive;
+    int sendBufferSize; // bytes, 0 leaves the system default
+    int receiveBufferSize;
+    qint64 congestionThreshold; // bulk lane threshold, 0 uses IvyQt's
+} IvyTransportProfile;
+
+// Resources a single peer may use, 0 leaves one unlimited
+typedef struct {
+    int maxFrameSize; // bytes in one received frame
+    int maxReceiveBuffer; // bytes read from the socket ahead of processing
+    int maxSubscriptions;
+    int maxPatternLength; // bytes
+    qint64 maxOutboundBytes; // queued and unsent to the peer
+    qint64 maxRetainedBytes; // received messages kept, oldest released, see ivyMessageReceived
+    bool disconnect; // on breach, otherwise the frame or binding is dropped
+} IvyPeerLimits;
+
+// Receive buffer is not breached, reading pauses at the limit
+typedef enum {
+    FrameSizeLimit = 0,
+    SubscriptionLimit = 1,
+    PatternLengthLimit = 2,
+    OutboundBytesLimit = 3,
+    RetainedBytesLimit = 4
+} IvyPeerLimit;
+
+typedef enum {
+    AgentRole = 0, // full mesh peer
+    HubRole = 1,   // mesh peer which also matches and fans out for members
+    MemberRole = 2 // connected to a single hub only
+} IvyRole;
+
 //typedef  struct _clnt_lst_dict *RWIvyClientPtr;
 //typedef  const struct _clnt_lst_dict *IvyClientPtr;
 
 //typedef enum { IvyApplicationConnected, IvyApplicationDisconnected,
 //           IvyApplicationCongestion , IvyApplicationDecongestion,
 //           IvyApplicationFifoFull } IvyApplicationEvent;
-//typedef enum { IvyAddBind, IvyRemoveBind, IvyFilterBind, IvyChangeBind } IvyBindEvent;
+typedef enum { IvyAddBind, IvyRemoveBind, IvyFilterBind, IvyChangeBind } IvyBindEvent;
 
 using namespace std;
 
 #include "ivymessage.h"
 #include "ivyclient.h"
+#include "ivyrecorder.h"
+#include "ivysubscriptiontable.h"
 
 // my attempt
 typedef enum { LogLevelHigh } IvyLogLevel;
 
 class IvyClient;
 
+// Peer remembered across restarts by the peer cache
+typedef struct {
+    QHostAddress address;
+    quint16 port; // listening TCP port
+    QByteArray appId;
+    QString name;
+    qint64 lastSeen; // msecs since epoch
+} IvyCachedPeer;
+
+// Match cost of one remote pattern, shared by its subscribers
+// Client, peer and identifier are those of one of them
+typedef struct {
+    IvyClient *client;
+    QString peer;
+    quint16 identifier;
+    QString pattern;
+    quint32 subscribers;
+    quint64 evaluations;
+    quint64 hits;
+    qint64 totalNanoseconds;
+    qint64 worstNanoseconds;
+    bool quarantined;
+} IvySubscriptionCost;
+
+// Pattern subscribed by one or more hub members, advertised to
+// mesh peers once under its own identifier
+typedef struct {
+    QString pattern;
+    quint16 identifier;
+    QList<QPair<IvyClient*, quint16> > targets; // member and its identifier
+} IvyRelay;
+
+// Message posted by IvyPostMsg, node of the posted message queue
+struct IvyPostedMsg {
+    QAtomicPointer<IvyPostedMsg> next;
+    QByteArray msg;
+    qint64 deadline;
+};
+
 class IvyQt : public QObject
 {
     Q_OBJECT
@@ -81,14 +172,44 @@ class IvyQt : public QObject
     static const quint8 defaultLogLevel = 9;
     static const QString defaultBusNetwork;
     static const quint16 defaultBusPort = 2010;
+    static const qint64 defaultCongestionThreshold = 64 * 1024;
+    static const quint16 hubRelayIdentifierBase = 0x8000;
+    static const qint64 peerCacheMaxAge = 24 * 3600 * 1000; // msecs
+    static const int peerCacheSaveDelay = 1000; // msecs
+    static const int defaultLastValueEntries = 1024;
+    static const int postedBatchLimit = 1024; // per event loop pass
 
 public:
+    // Sole subscription a hub gives its members, so each member
+    // message reaches the hub once for central matching
+    static const quint16 hubCatchAllIdentifier = 0xFFFF;
+    static const QString hubCatchAllPattern;
+
     explicit IvyQt(QObject *parent = 0);
     IvyQt(QString name, QObject *parent = 0);
+    ~IvyQt();
 
     void IvyInit(QByteArray *appName, QByteArray *readyMsg);
     void IvyInit(char *appName, char *readyMsg);
     void IvyStart(QString network = "");
+
+    // Peers seen recently are stored in fileName and connected to
+    // directly by IvyStart, alongside UDP discovery. A cached peer
+    // is only trusted once its StartRegexp confirms name and port.
+    void setPeerCache(const QString &fileName);
+    bool confirmCachedPeer(IvyClient *client, const QString &name, quint16 port);
+    void forgetCachedPeer(IvyClient *client);
+
+    // Star topology for large buses
+    // A hub joins the bus as a normal agent and accepts members on a
+    // separate port. Members connect to the hub only and publish each
+    // message once; the hub matches it against every other peer and
+    // advertises the union of member subscriptions to the mesh.
+    // Direct messages are not relayed.
+    void IvyStartHub(QString network = "", quint16 memberPort = 0);
+    void IvyStartMember(const QHostAddress &hubAddress, quint16 hubPort);
+    IvyRole role;
+    quint16 hubPort; // member port while hub, 0 otherwise
     void IvyDie();
     void IvyStop(void);
 
@@ -102,23 +223,140 @@ public:
     int IvyUnBind(quint16 identifier);
     int IvyClearBindings(void);
 
-    void IvySendMsg(QByteArray *msg);
-    void IvySendMsg(const char *msg) { IvySendMsg(new QByteArray(msg)); }
-    void IvySendMsg(QString msg) { IvySendMsg(msg.toUtf8()); }
-    void IvySendMsg(QByteArray msg) { IvySendMsg(&msg); }
+    // Bulk binding, propagated to each peer in a single write
+    QList<int> IvyBindMany(const QStringList &patterns, QObject *receiver = 0, const char *member = 0);
+    int IvyUnBindMany(const QList<quint16> &identifiers);
+    void IvyBeginBind();
+    void IvyCommitBind();
+
+    // Optional time to live in milliseconds, copies still queued
+    // for a congested peer when it passes are discarded unsent
+    void IvySendMsg(QByteArray *msg, int ttl = 0);
+    void IvySendMsg(const char *msg, int ttl = 0) { QByteArray data(msg); IvySendMsg(&data,ttl); }
+    void IvySendMsg(QString msg, int ttl = 0) { IvySendMsg(msg.toUtf8(),ttl); }
+    void IvySendMsg(QByteArray msg, int ttl = 0) { IvySendMsg(&msg,ttl); }
+
+    // IvySendMsg for any thread, published later by the bus thread
+    // which drains posted messages in batches. Posting takes no lock
+    // and wakes the bus thread once however many posts precede it.
+    void IvyPostMsg(const QByteArray &msg, int ttl = 0);
+    void IvyPostMsg(const char *msg, int ttl = 0) { IvyPostMsg(QByteArray(msg),ttl); }
+
+    int IvySendDirectMsg(IvyClient *client, quint32 identifier, const QByteArray &payload);
+    int IvySendDirectMsg(const QString &peerName, quint32 identifier, const QByteArray &payload);
 
     int addIvyClient(QHostAddress* host, quint16* port, QString* name, QByteArray *appId = 0);
     void addIvyClient(IvyClient *client);
+    quint32 nextPeerId;
     IvyClient* findClient(QHostAddress* host, quint16* port, QString* name);
+    IvyClient* clientByName(const QString &name) { return clientsByName.value(name, 0); }
+    bool resolveDuplicateClient(IvyClient *client);
+    bool mayPipelineSubscriptions(IvyClient *client);
     QList<IvyClient*> clients;
 
     Subscription* subscriptionByIdentifier(quint16 identifier);
     QList<Subscription*> subscriptions;
 
+    // Subscriptions of every peer, return TRUE if identifier
+    // replaced or removed an existing one
+    IvySubscriptionTable remoteSubscriptions;
+    bool addRemoteSubscription(IvyClient *client, quint16 identifier, const QString &pattern);
+    bool removeRemoteSubscription(IvyClient *client, quint16 identifier);
+    const QByteArray &encodedSubscriptions(IvyClient *client = 0);
+    int advertisedSubscriptionCount(IvyClient *client = 0);
+
+    // Hub relays of member subscriptions
+    void addRelayTarget(IvyClient *member, quint16 identifier, const QString &pattern);
+    void removeRelayTarget(IvyClient *member, quint16 identifier);
+
     void logMessage(QString *msg, quint16 level);
     void logMessage(const char *msg, quint16 level) { logMessage(new QString(msg),level); }
     void logMessage(QString msg, quint16 level) { logMessage(&msg, level); }
 
+    // Record raw inbound frames to a memory mapped file
+    // Replay with IvyReplay
+    bool IvyStartRecording(const QString &fileName);
+    void IvyStopRecording();
+    IvyRecorder *recorder; // 0 unless recording
+
+    // Timestamp received messages at each processing stage
+    // and accumulate per client latency histograms
+    void setLatencyTracing(bool enabled) { latencyTracing = enabled; }
+    bool latencyTracing;
+
+    // Message heads this agent may emit, as Ivy-C IvySetFilter
+    // Remote bindings anchored on a literal which no head can start
+    // with are parked as filtered rows rather than evaluated on
+    // every IvySendMsg. An empty list accepts all.
+    // Ignored by a hub, which publishes on behalf of its members.
+    void IvySetFilter(const QStringList &heads);
+    QStringList filterHeads() { return _filterHeads; }
+    quint32 statsFilteredBindings;
+
+    // Remote pattern cost
+    // Profiling times every match in IvySendMsg. A non-zero budget
+    // also times every match, and quarantines a remote pattern the
+    // first time a single match exceeds it: it is then skipped for
+    // every peer until the last of them replaces it
+    void setMatchProfiling(bool enabled) { matchProfiling = enabled; }
+    void setMatchTimeBudget(qint64 usec) { matchTimeBudget = usec * 1000; }
+    QList<IvySubscriptionCost> subscriptionCostReport(int count = 10);
+    bool matchProfiling;
+    qint64 matchTimeBudget; // nanoseconds, 0 disabled
+    quint32 statsQuarantinedSubscriptions; // patterns
+
+    // Remote patterns are compiled on a worker pool, once however
+    // many peers subscribe to them. A peer is not ready and its
+    // subscriptions are not matched until compiled
+    void setBackgroundCompilation(bool enabled) { backgroundCompilation = enabled; }
+    bool backgroundCompilation;
+
+    // Transport profile for every peer, or for peers by agent name
+    // Applies to connected peers immediately
+    void setTransport(IvyTransport transport);
+    void setPeerTransport(const QString &peerName, IvyTransport transport);
+    IvyTransport transportFor(const QString &peerName) { return peerTransports.value(peerName, defaultTransport); }
+    static IvyTransportProfile transportProfile(IvyTransport transport);
+    static const char *transportName(IvyTransport transport);
+
+    // Resource limits for every peer, or for peers by agent name
+    // Applies to connected peers immediately
+    void setPeerLimits(const IvyPeerLimits &limits);
+    void setPeerLimits(const QString &peerName, const IvyPeerLimits &limits);
+    IvyPeerLimits limitsFor(const QString &peerName) { return peerLimits.value(peerName, defaultPeerLimits); }
+    static IvyPeerLimits unlimited();
+    static const char *limitName(IvyPeerLimit limit);
+
+    // Latest-value conflation of matching remote subscriptions
+    // for peers with at least congestionThreshold unsent bytes,
+    // which is also the point at which bulk frames are queued
+    // behind control frames
+    void setConflation(const QString &pattern, bool enabled = true);
+    bool isConflated(const QString &pattern) { return conflatedPatterns.contains(pattern); }
+    qint64 congestionThreshold; // unless the peer transport profile sets one
+
+    // Last-value cache of messages sent by IvySendMsg, off by default
+    // A message replaces the cached one with the same key: the first
+    // capture of keyPattern, its whole match without captures, or the
+    // message head before the first space without a pattern, where a
+    // message without a space is not cached. Remote subscriptions
+    // receive the cached messages they match as soon as they are
+    // active, so agents joining late see current state without
+    // producers republishing it. Messages sent with a time to live
+    // are not cached. At most maxEntries keys, 0 unlimited.
+    void setLastValueCache(bool enabled, const QString &keyPattern = QString(), int maxEntries = defaultLastValueEntries);
+    void clearLastValueCache() { lastValues.clear(); }
+    int lastValueCount() { return lastValues.count(); }
+    bool lastValueCaching;
+    quint32 statsLastValueReplays; // messages sent from the cache
+    quint32 statsLastValuesDropped; // new keys refused at maxEntries
+
+    // Batched delivery to slot(QVector<IvyMessage*>) bindings
+    // 0 delivers once per socket read, otherwise at most every msec
+    void setBatchWindow(int msec) { batchWindow = msec; }
+    int batchWindow;
+
+    bool isLogging(quint16 level);
     void setLogLevel(quint16 level);
     quint16 logLevel();
 
@@ -127,8 +365,14 @@ public:
     quint32 statsTcpBytesOut;
     quint32 statsUdpBytesIn;
     quint32 statsUdpBytesOut;
-    quint16 messageCountStatsIn[10];
-    quint16 messageCountStatsOut[10];
+    quint16 messageCountStatsIn[11]; // indexed by MsgType
+    quint16 messageCountStatsOut[11];
+    quint32 statsHubMemberMessages; // matched centrally for members
+    quint32 statsHubRelayedMessages; // forwarded from mesh to members
+
+    // Time from IvyStart until every known peer is ready
+    QElapsedTimer busJoinElapsedTimer;
+    qint64 busTimeToReady; // microseconds, -1 until ready
 
     //    int IvySendMsg( const char *fmt_message, ... )
 
@@ -144,6 +388,9 @@ public:
     QTcpServer* tcpServer;
     QHostAddress localTcpAddress;
 
+    // Hub member connections, 0 unless hub
+    QTcpServer* hubServer;
+
 private:
 
     bool active; // should this instead be ready?
@@ -151,6 +398,9 @@ private:
 
     QList<Bus*> busNetworks;
 
+    // Ready clients by agent name, for direct messages
+    QHash<QString, IvyClient*> clientsByName;
+
     // QStringList busNetworks;
     QStringList busNetworkMasks;
 
@@ -162,6 +412,89 @@ private:
 
     void sendSubscriptions();
 
+    void dropClient(IvyClient *client);
+    void acceptConnections(QTcpServer *server, bool member);
+
+    quint16 publish(QByteArray *msg, qint64 deadline, IvyClient *source = 0);
+    void quarantinePattern(int row, qint64 nanoseconds);
+    bool isFilteredBinding(int row);
+    bool filterBinding(int row);
+    bool compilePattern(int pattern);
+    void removeRemoteSubscriptions(IvyClient *client);
+
+    // Hub
+    QMap<quint16, IvyRelay*> relays;
+    QHash<QString, IvyRelay*> relaysByPattern;
+    quint16 nextRelayIdentifier;
+    QList<quint16> freeRelayIdentifiers; // released by withdrawn relays
+    quint16 allocateRelayIdentifier();
+    void propagateToMesh(const QByteArray &frame, MsgType type);
+    void relayMemberMessage(IvyMessage *ivymsg);
+    void relayMeshMessage(IvyMessage *ivymsg, IvyRelay *relay);
+    void deliverLocally(QByteArray *msg, IvyClient *source);
+    void removeRelayTargets(IvyClient *member);
+
+    int bind(const QString *pattern, QObject *receiver, const char *member);
+    bool unbind(quint16 identifier);
+
+    // Subscription changes awaiting IvyCommitBind
+    quint16 bindTransactionDepth;
+    QByteArray pendingBindFrames;
+    int pendingBindAddCount;
+    int pendingBindDelCount;
+
+    QSet<QString> conflatedPatterns;
+
+    // Last-value cache, messages by key
+    QMap<QByteArray, QByteArray> lastValues;
+    QRegExp lastValueKey; // empty keys on the message head
+    int maxLastValues;
+    QByteArray lastValueKeyOf(const QByteArray &msg);
+    void cacheLastValue(const QByteArray &msg);
+    void replayLastValues(int row);
+
+    QStringList _filterHeads;
+
+    // Peer cache, keyed by address:port
+    QString peerCacheFileName;
+    QHash<QString, IvyCachedPeer> peerCache;
+    QTimer peerCacheSaveTimer;
+    static QString peerCacheKey(const QHostAddress &address, quint16 port);
+    void loadPeerCache();
+    void connectCachedPeers();
+    void rememberPeer(IvyClient *client);
+
+    // Background compilation jobs, pattern handle by job id
+    QThreadPool compilePool;
+    QHash<quint32, int> compileJobs;
+    quint32 nextCompileJob;
+
+    IvyTransport defaultTransport;
+    QHash<QString, IvyTransport> peerTransports;
+
+    IvyPeerLimits defaultPeerLimits;
+    QHash<QString, IvyPeerLimits> peerLimits;
+
+    // Posted messages, Vyukov's intrusive multi producer queue
+    // Producers swap their node in at postHead, the bus thread alone
+    // pops from postTail. The stub node keeps the queue non empty.
+    QAtomicPointer<IvyPostedMsg> postHead;
+    IvyPostedMsg *postTail;
+    IvyPostedMsg postStub;
+    QAtomicInt postWakeupPending;
+    void pushPostedMsg(IvyPostedMsg *node);
+    IvyPostedMsg *popPostedMsg();
+    bool postedMsgsWaiting() { return postTail != &postStub || postHead.loadAcquire() != &postStub; }
+
+    // Subscriptions with messages awaiting batch delivery
+    QList<Subscription*> pendingBatchSubscriptions;
+    QTimer batchTimer;
+
+    // AddRegexp list and EndRegexp shared by all handshakes
+    QByteArray subscriptionFrames;
+    bool subscriptionFramesValid;
+    QByteArray memberSubscriptionFrames;
+
     quint16 _logLevel;
 
     QByteArray generateAppId(quint16 port);
@@ -183,11 +516,22 @@ signals:
     void ivyClientBye(IvyClient *client);
     void ivyClientBye(QString *name, QHostAddress *address, quint16 port);
     void ivyClientPong(IvyClient *client, qint16 id, qint64 roundtrip);
+    void ivyBusReady(qint64 timeToReady);
 
     // void ivyBusTraffic(BusTrafficDirection direction = Both, qint32 bytes = 0, BusTrafficProtocol = Either, IvyClient* client = 0);
 
+    void ivyBindEvent(IvyClient *client, quint16 identifier, const QString &pattern, IvyBindEvent event);
+
+    void ivySubscriptionQuarantined(IvyClient *client, quint16 identifier, const QString &pattern, qint64 nanoseconds);
+    void ivyPeerLimitExceeded(IvyClient *client, IvyPeerLimit limit, qint64 value);
+
     void ivyMessagesSent(quint16 msgCount);
+    // With maxRetainedBytes set, a message may be released on the bus
+    // thread once newer ones arrive. Slots in other threads, reached
+    // through queued connections, must not hold on to the pointer, and
+    // should copy what they need from a direct connection instead
     void ivyMessageReceived(IvyMessage* ivymsg);
+    void ivyDirectMessageReceived(IvyMessage* ivymsg);
     void formattedLogMessage(QString* logmsg, quint16 level);
 
     void ivyBusTrafficStats(BusTrafficDirection direction, qint32 bytes, BusTrafficProtocol protocol, IvyClient* client = 0);
@@ -204,12 +548,18 @@ public slots:
 
     //void on_ivyMessageReceived(quint16 identifier, QList<QByteArray> *args, IvyClient* client);
     void on_ivyMessageReceived(IvyMessage* ivymsg);
+    void on_ivyDirectMessageReceived(IvyMessage* ivymsg);
+    void flushBatches();
 
     void on_ivyBusTrafficStats(BusTrafficDirection direction, qint32 bytes, BusTrafficProtocol protocol, IvyClient* client = 0);
     void on_ivyBusMessageStats(quint8 type, BusTrafficDirection direction, IvyClient* client = 0);
 
     void readPendingDatagrams();
     void onTcpServerNewConnection();
+    void onHubServerNewConnection();
+    void savePeerCache();
+    void onSubscriptionCompiled(quint32 job, QRegExp regexp);
+    void drainPostedMessages();
 
 };
 
@@ -0,0 +1,147 @@
+#include "ivyrecorder.h"
+
+#include <QDateTime>
+#include <string.h>
+
+const char IvyRecorder::fileMagic[8] = { 'I', 'V', 'Y', 'R', 'E', 'C', '0', '1' };
+
+IvyRecorder::IvyRecorder(QObject *parent) :
+    QObject(parent)
+{
+    map = 0;
+    mapOffset = 0;
+    mapPosition = 0;
+    mapSize = 0;
+
+    recordCount = 0;
+    nextIndexTimestamp = 0;
+}
+
+IvyRecorder::~IvyRecorder()
+{
+    close();
+}
+
+// Create recording, replacing any existing file of that name
+// Return TRUE on success
+bool IvyRecorder::open(const QString &fileName)
+{
+    close();
+
+    file.setFileName(fileName);
+    indexFile.setFileName(fileName + ".idx");
+
+    if (!file.open(QIODevice::ReadWrite | QIODevice::Truncate)) return false;
+    if (!indexFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        file.close();
+        return false;
+    }
+
+    IvyRecordFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, fileMagic, sizeof(header.magic));
+    header.startMSecsSinceEpoch = QDateTime::currentMSecsSinceEpoch();
+    file.write((const char*)&header, sizeof(header));
+    file.flush();
+
+    mapOffset = sizeof(header);
+    mapPosition = 0;
+    mapSize = 0;
+
+    recordCount = 0;
+    nextIndexTimestamp = 0;
+
+    elapsedTimer.start();
+
+    if (!remap(0)) {
+        file.close();
+        indexFile.close();
+        return false;
+    }
+
+    return true;
+}
+
+// Unmap and trim the preallocated tail
+void IvyRecorder::close()
+{
+    if (!file.isOpen()) return;
+
+    qint64 end = size();
+
+    if (map) file.unmap(map);
+    map = 0;
+
+    file.resize(end);
+    file.close();
+    indexFile.close();
+}
+
+void IvyRecorder::recordFrame(quint32 peerId, const QByteArray &frame)
+{
+    append(RecordFrame, peerId, frame.constData(), frame.size());
+}
+
+void IvyRecorder::recordPeer(quint32 peerId, const QString &name, const QByteArray &appId)
+{
+    QByteArray data = name.toUtf8();
+    data.append(0x03);
+    data.append(appId);
+    append(RecordPeer, peerId, data.constData(), data.size());
+}
+
+// Copy one record into the mapped segment, mapping a new
+// segment at the current end of file when it does not fit
+void IvyRecorder::append(IvyRecordKind kind, quint32 peerId, const char *data, quint32 length)
+{
+    if (!map) return;
+
+    qint64 recordSize = sizeof(IvyRecordHeader) + ((length + 7) & ~7);
+    if (mapPosition + recordSize > mapSize && !remap(recordSize)) return;
+
+    IvyRecordHeader header;
+    header.timestamp = elapsedTimer.nsecsElapsed();
+    header.peerId = peerId;
+    header.kind = kind;
+    header.reserved = 0;
+    header.length = length;
+    header.padding = 0;
+
+    // Padding bytes are already zero in the freshly extended file
+    memcpy(map + mapPosition, &header, sizeof(header));
+    memcpy(map + mapPosition + sizeof(header), data, length);
+
+    if (header.timestamp >= nextIndexTimestamp) {
+        IvyRecordIndexEntry entry;
+        entry.timestamp = header.timestamp;
+        entry.offset = size();
+        indexFile.write((const char*)&entry, sizeof(entry));
+        indexFile.flush(); // survives a crash as the mapped records do
+        nextIndexTimestamp = header.timestamp + indexInterval;
+    }
+
+    mapPosition += recordSize;
+    recordCount++;
+}
+
+// Extend the file and map the next segment from the write position
+// so records never straddle two mappings
+bool IvyRecorder::remap(qint64 minimum)
+{
+    qint64 offset = size();
+    qint64 length = qMax(segmentSize, minimum);
+
+    if (map) file.unmap(map);
+    map = 0;
+
+    if (!file.resize(offset + length)) return false;
+
+    map = file.map(offset, length);
+    if (!map) return false;
+
+    mapOffset = offset;
+    mapPosition = 0;
+    mapSize = length;
+
+    return true;
+}
@@ -0,0 +1,85 @@
+#ifndef IVYRECORDER_H
+#define IVYRECORDER_H
+
+#include <QObject>
+#include <QFile>
+#include <QElapsedTimer>
+
+// Recording file layout, host byte order
+//
+// File header followed by records, each record header is followed
+// by its payload padded to 8 bytes. A zeroed record header marks
+// the end of a recording which was not closed cleanly.
+//
+// A companion <file>.idx holds IvyRecordIndexEntry pairs of
+// timestamp and file offset, written at most every indexInterval
+
+typedef enum {
+    RecordEnd = 0,
+    RecordFrame = 1, // raw TCP frame received from peer, without EOL
+    RecordPeer = 2   // peer identity, name<ETX>appId
+} IvyRecordKind;
+
+typedef struct {
+    char magic[8];
+    quint64 startMSecsSinceEpoch;
+    quint64 reserved[2];
+} IvyRecordFileHeader;
+
+typedef struct {
+    quint64 timestamp; // nanoseconds since recording start
+    quint32 peerId;
+    quint16 kind;
+    quint16 reserved;
+    quint32 length; // payload bytes
+    quint32 padding;
+} IvyRecordHeader;
+
+typedef struct {
+    quint64 timestamp;
+    quint64 offset;
+} IvyRecordIndexEntry;
+
+class IvyRecorder : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    static const char fileMagic[8];
+    static const qint64 segmentSize = 64 * 1024 * 1024; // bytes mapped at a time
+    static const qint64 indexInterval = 100 * 1000 * 1000; // nanoseconds
+
+    explicit IvyRecorder(QObject *parent = 0);
+    ~IvyRecorder();
+
+    bool open(const QString &fileName);
+    void close();
+    bool isOpen() { return map != 0; }
+
+    void recordFrame(quint32 peerId, const QByteArray &frame);
+    void recordPeer(quint32 peerId, const QString &name, const QByteArray &appId);
+
+    // Statistics
+    quint64 recordCount;
+    qint64 size() { return mapOffset + mapPosition; }
+
+private:
+
+    void append(IvyRecordKind kind, quint32 peerId, const char *data, quint32 length);
+    bool remap(qint64 minimum);
+
+    QFile file;
+    QFile indexFile;
+
+    uchar *map;
+    qint64 mapOffset; // file offset of mapped segment
+    qint64 mapPosition; // write position within segment
+    qint64 mapSize;
+
+    QElapsedTimer elapsedTimer;
+    quint64 nextIndexTimestamp;
+
+};
+
+#endif // IVYRECORDER_H
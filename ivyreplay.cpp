@@ -0,0 +1,219 @@
+#include "ivyreplay.h"
+#include "ivyqt.h"
+
+#include <string.h>
+
+IvyReplay::IvyReplay(IvyQt *ivyQt, QObject *parent) :
+    QObject(parent)
+{
+    this->ivyQt = ivyQt;
+
+    data = 0;
+    dataSize = 0;
+    dataOffset = 0;
+
+    _speed = 1.0;
+    running = false;
+
+    playbackBaseTimestamp = 0;
+    currentTimestamp = 0;
+    lastTimestamp = 0;
+
+    messagesReplayed = 0;
+
+    timer.setSingleShot(true);
+    connect(&timer, SIGNAL(timeout()), this, SLOT(onTimerTimeout()));
+}
+
+IvyReplay::~IvyReplay()
+{
+    close();
+}
+
+// Map a recording and load its time index
+// Return TRUE on success
+bool IvyReplay::open(const QString &fileName)
+{
+    close();
+
+    file.setFileName(fileName);
+    if (!file.open(QIODevice::ReadOnly)) return false;
+
+    dataSize = file.size();
+    if (dataSize < (qint64)sizeof(IvyRecordFileHeader)) {
+        file.close();
+        return false;
+    }
+
+    data = file.map(0, dataSize);
+    if (!data || memcmp(data, IvyRecorder::fileMagic, sizeof(IvyRecorder::fileMagic))) {
+        close();
+        return false;
+    }
+
+    // Index is optional, seeking falls back to a linear scan
+    QFile indexFile(fileName + ".idx");
+    if (indexFile.open(QIODevice::ReadOnly)) {
+        IvyRecordIndexEntry entry;
+        while (indexFile.read((char*)&entry, sizeof(entry)) == sizeof(entry))
+            index.append(entry);
+    }
+
+    // Walk from the last index entry to find the end of the recording
+    IvyRecordHeader header;
+    qint64 offset = index.count() ? (qint64)index.last().offset : (qint64)sizeof(IvyRecordFileHeader);
+    while (readHeader(offset, &header)) {
+        lastTimestamp = header.timestamp;
+        offset += sizeof(header) + ((header.length + 7) & ~7);
+    }
+
+    dataOffset = sizeof(IvyRecordFileHeader);
+    currentTimestamp = 0;
+
+    return true;
+}
+
+void IvyReplay::close()
+{
+    stop();
+
+    if (data) file.unmap(data);
+    data = 0;
+    dataSize = 0;
+
+    if (file.isOpen()) file.close();
+
+    index.clear();
+    lastTimestamp = 0;
+}
+
+void IvyReplay::setSpeed(double speed)
+{
+    _speed = speed;
+
+    // Re-anchor so the change applies from the current position
+    if (running) {
+        playbackBaseTimestamp = currentTimestamp;
+        playbackElapsedTimer.start();
+        timer.start(0);
+    }
+}
+
+// Position on the first record at or after msec from the
+// start of the recording, a negative msec seeks to the start
+bool IvyReplay::seek(qint64 msec)
+{
+    if (!data) return false;
+
+    quint64 target = (quint64)qMax(msec, (qint64)0) * 1000000;
+
+    // Last index entry not after target
+    qint64 offset = sizeof(IvyRecordFileHeader);
+    int lower = 0, upper = index.count();
+    while (lower < upper) {
+        int middle = (lower + upper) / 2;
+        if (index.at(middle).timestamp <= target) lower = middle + 1;
+        else upper = middle;
+    }
+    if (lower > 0) offset = index.at(lower - 1).offset;
+
+    IvyRecordHeader header;
+    while (readHeader(offset, &header) && header.timestamp < target)
+        offset += sizeof(header) + ((header.length + 7) & ~7);
+
+    dataOffset = offset;
+    currentTimestamp = target;
+
+    if (running) {
+        playbackBaseTimestamp = currentTimestamp;
+        playbackElapsedTimer.start();
+    }
+
+    return true;
+}
+
+void IvyReplay::start()
+{
+    if (!data || running) return;
+
+    running = true;
+    playbackBaseTimestamp = currentTimestamp;
+    playbackElapsedTimer.start();
+    timer.start(0);
+}
+
+void IvyReplay::stop()
+{
+    running = false;
+    timer.stop();
+}
+
+// Return TRUE if a complete record header is available at offset
+bool IvyReplay::readHeader(qint64 offset, IvyRecordHeader *header)
+{
+    if (offset + (qint64)sizeof(IvyRecordHeader) > dataSize) return false;
+
+    memcpy(header, data + offset, sizeof(IvyRecordHeader));
+    if (header->kind == RecordEnd) return false;
+
+    return (offset + (qint64)sizeof(IvyRecordHeader) + header->length <= dataSize);
+}
+
+// Publish every record which is due, bounded per pass so the
+// event loop keeps running at maximum speed, then sleep until
+// the next record
+void IvyReplay::onTimerTimeout()
+{
+    if (!running) return;
+
+    IvyRecordHeader header;
+    for (int i = 0; i < maxBatch; i++) {
+        if (!readHeader(dataOffset, &header)) {
+            running = false;
+            emit finished();
+            return;
+        }
+
+        if (_speed > 0) {
+            qint64 due = (header.timestamp - playbackBaseTimestamp) / _speed;
+            qint64 wait = (due - playbackElapsedTimer.nsecsElapsed()) / 1000000;
+            if (wait > 0) {
+                timer.start(wait);
+                return;
+            }
+        }
+
+        replayRecord(header, (const char*)data + dataOffset + sizeof(header));
+
+        currentTimestamp = header.timestamp;
+        dataOffset += sizeof(header) + ((header.length + 7) & ~7);
+    }
+
+    timer.start(0);
+}
+
+void IvyReplay::replayRecord(const IvyRecordHeader &header, const char *payload)
+{
+    // Peer records only name the source of frames, which
+    // are republished as our own messages
+    if (header.kind == RecordPeer) return;
+
+    // Only Msg frames are republished: "2 <id><STX>arg<ETX>arg<ETX>"
+    if (header.length < 2 || payload[0] != '0' + Msg || payload[1] != ' ') return;
+
+    QByteArray frame = QByteArray::fromRawData(payload, header.length);
+    int stxPos = frame.indexOf(ARG_START);
+    if (stxPos < 0) return;
+
+    QList<QByteArray> parameters = frame.mid(stxPos + 1).split(ARG_END);
+    if (parameters.count() && parameters.last().isEmpty()) parameters.removeLast();
+
+    QByteArray message;
+    for (int i = 0; i < parameters.count(); i++) {
+        if (i) message.append(' ');
+        message.append(parameters.at(i));
+    }
+
+    ivyQt->IvySendMsg(&message);
+    messagesReplayed++;
+}
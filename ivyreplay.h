@@ -0,0 +1,81 @@
+#ifndef IVYREPLAY_H
+#define IVYREPLAY_H
+
+#include <QObject>
+#include <QFile>
+#include <QTimer>
+#include <QElapsedTimer>
+
+#include "ivyrecorder.h"
+
+class IvyQt;
+
+// Republish an IvyRecorder recording through IvySendMsg
+//
+// Recorded Msg frames carry the captures of the recording agent's
+// binding rather than the original message, so the captures are
+// joined with spaces. Record with a catch-all binding such as
+// "^(.*)$" to replay messages verbatim.
+class IvyReplay : public QObject
+{
+    Q_OBJECT
+
+public:
+
+    static const int maxBatch = 1000; // records per event loop pass
+
+    IvyReplay(IvyQt *ivyQt, QObject *parent = 0);
+    ~IvyReplay();
+
+    bool open(const QString &fileName);
+    void close();
+
+    // 1.0 is real time, 0 is as fast as possible
+    void setSpeed(double speed);
+    double speed() { return _speed; }
+
+    bool seek(qint64 msec);
+    qint64 position() { return currentTimestamp / 1000000; }
+    qint64 duration() { return lastTimestamp / 1000000; }
+
+    void start();
+    void stop();
+    bool isRunning() { return running; }
+
+    // Statistics
+    quint64 messagesReplayed;
+
+private:
+
+    bool readHeader(qint64 offset, IvyRecordHeader *header);
+    void replayRecord(const IvyRecordHeader &header, const char *payload);
+
+    IvyQt *ivyQt;
+
+    QFile file;
+    uchar *data;
+    qint64 dataSize;
+    qint64 dataOffset; // next record
+
+    QList<IvyRecordIndexEntry> index;
+
+    double _speed;
+    bool running;
+
+    QTimer timer;
+    QElapsedTimer playbackElapsedTimer;
+    quint64 playbackBaseTimestamp;
+    quint64 currentTimestamp;
+    quint64 lastTimestamp;
+
+signals:
+
+    void finished();
+
+private slots:
+
+    void onTimerTimeout();
+
+};
+
+#endif // IVYREPLAY_H
@@ -0,0 +1,263 @@
+#include "ivysubscriptiontable.h"
+
+IvySubscriptionTable::IvySubscriptionTable()
+{
+    generation = 0;
+}
+
+int IvySubscriptionTable::addPeer(IvyClient *client)
+{
+    if (!freePeers.isEmpty()) {
+        int peer = freePeers.takeLast();
+        peerClients[peer] = client;
+        return peer;
+    }
+
+    peerClients.append(client);
+    denseRows.append(QVector<qint32>());
+    sparseRows.append(QHash<quint16, qint32>());
+
+    return peerClients.count() - 1;
+}
+
+// Remove every row of the peer and release its slot
+void IvySubscriptionTable::removePeer(int peer)
+{
+    if (peer < 0 || peer >= peerClients.count() || !peerClients.at(peer)) return;
+
+    QVector<qint32> dense = denseRows.at(peer);
+    for (int i = 0; i < dense.count(); i++)
+        if (dense.at(i) >= 0) remove(dense.at(i));
+
+    QHash<quint16, qint32> sparse = sparseRows.at(peer);
+    QHash<quint16, qint32>::const_iterator it;
+    for (it = sparse.constBegin(); it != sparse.constEnd(); ++it)
+        remove(it.value());
+
+    denseRows[peer].clear();
+    sparseRows[peer].clear();
+    peerClients[peer] = 0;
+    freePeers.append(peer);
+}
+
+int IvySubscriptionTable::find(int peer, quint16 identifier) const
+{
+    if (peer < 0 || peer >= peerClients.count()) return -1;
+
+    if (identifier < denseIdentifierLimit) {
+        const QVector<qint32> &dense = denseRows.at(peer);
+        return (identifier < dense.count()) ? dense.at(identifier) : -1;
+    }
+
+    return sparseRows.at(peer).value(identifier, -1);
+}
+
+// Caller removes any row already holding identifier and has
+// acquired pattern for the new row
+int IvySubscriptionTable::insert(int peer, quint16 identifier, int pattern, RowState state)
+{
+    int row;
+    if (!freeRows.isEmpty()) {
+        row = freeRows.takeLast();
+        peers[row] = peer;
+        identifiers[row] = identifier;
+        patterns[row] = pattern;
+        states[row] = state;
+    } else {
+        row = states.count();
+        peers.append(peer);
+        identifiers.append(identifier);
+        patterns.append(pattern);
+        states.append(state);
+    }
+
+    if (identifier < denseIdentifierLimit) {
+        QVector<qint32> &dense = denseRows[peer];
+        while (dense.count() <= identifier) dense.append(-1);
+        dense[identifier] = row;
+    } else sparseRows[peer].insert(identifier, row);
+
+    return row;
+}
+
+void IvySubscriptionTable::remove(int row)
+{
+    if (states.at(row) == RowFree) return;
+
+    int peer = peers.at(row);
+    quint16 identifier = identifiers.at(row);
+    if (identifier < denseIdentifierLimit) denseRows[peer][identifier] = -1;
+    else sparseRows[peer].remove(identifier);
+
+    releasePattern(patterns.at(row));
+
+    states[row] = RowFree;
+    patterns[row] = -1;
+    freeRows.append(row);
+}
+
+int IvySubscriptionTable::acquirePattern(const QString &text)
+{
+    int pattern = patternsByText.value(text, -1);
+    if (pattern >= 0) {
+        references[pattern]++;
+        return pattern;
+    }
+
+    // QRegExp::RegExp is the most perl like, as Subscription
+    QRegExp regexp(text, Qt::CaseSensitive, QRegExp::RegExp);
+
+    if (!freePatterns.isEmpty()) {
+        pattern = freePatterns.takeLast();
+        regexps[pattern] = regexp;
+        prefixes[pattern] = anchoredLiteral(text).toUtf8();
+        bounds[pattern] = matchBound(text);
+        references[pattern] = 1;
+        patternFlags[pattern] = 0;
+        compileJobs[pattern] = 0;
+        evaluations[pattern] = 0;
+        hits[pattern] = 0;
+        matchNanoseconds[pattern] = 0;
+        worstMatchNanoseconds[pattern] = 0;
+        generations[pattern] = 0;
+        results[pattern] = -1;
+    } else {
+        pattern = regexps.count();
+        regexps.append(regexp);
+        prefixes.append(anchoredLiteral(text).toUtf8());
+        bounds.append(matchBound(text));
+        references.append(1);
+        patternFlags.append(0);
+        compileJobs.append(0);
+        evaluations.append(0);
+        hits.append(0);
+        matchNanoseconds.append(0);
+        worstMatchNanoseconds.append(0);
+        generations.append(0);
+        results.append(-1);
+    }
+
+    patternsByText.insert(text, pattern);
+
+    return pattern;
+}
+
+// The engine is freed with the last row using the pattern
+void IvySubscriptionTable::releasePattern(int pattern)
+{
+    if (--references[pattern]) return;
+
+    patternsByText.remove(regexps.at(pattern).pattern());
+    pendingRows.remove(pattern);
+
+    regexps[pattern] = QRegExp();
+    prefixes[pattern].clear();
+    compileJobs[pattern] = 0;
+    freePatterns.append(pattern);
+}
+
+quint32 IvySubscriptionTable::nextGeneration()
+{
+    if (!++generation) {
+        generations.fill(0);
+        generation = 1;
+    }
+    return generation;
+}
+
+void IvySubscriptionTable::clear()
+{
+    peers.clear();
+    identifiers.clear();
+    patterns.clear();
+    states.clear();
+
+    regexps.clear();
+    prefixes.clear();
+    bounds.clear();
+    references.clear();
+    patternFlags.clear();
+    compileJobs.clear();
+    evaluations.clear();
+    hits.clear();
+    matchNanoseconds.clear();
+    worstMatchNanoseconds.clear();
+    pendingRows.clear();
+    generations.clear();
+    results.clear();
+
+    patternsByText.clear();
+    freeRows.clear();
+    freePatterns.clear();
+
+    peerClients.clear();
+    freePeers.clear();
+    denseRows.clear();
+    sparseRows.clear();
+}
+
+// Literal text a message must start with to match pattern,
+// empty if the pattern is not anchored or starts with a
+// metacharacter. Alternation could unanchor a branch.
+QString IvySubscriptionTable::anchoredLiteral(const QString &pattern)
+{
+    QString literal;
+
+    if (!pattern.startsWith('^') || pattern.contains('|')) return literal;
+
+    for (int i = 1; i < pattern.size(); i++) {
+        QChar c = pattern.at(i);
+
+        // Preceding character may be absent
+        if (c == '?' || c == '*' || c == '{') {
+            literal.chop(1);
+            break;
+        }
+        if (QString(".[]()+\\$^").contains(c)) break;
+
+        literal.append(c);
+    }
+
+    return literal;
+}
+
+// Characters of the message an anchored pattern without repetition
+// or end anchor can examine: each atom consumes at most one, plus
+// one of look ahead for \b. 0 if the whole message may be needed,
+// including for back references, lookahead and top level alternation.
+int IvySubscriptionTable::matchBound(const QString &pattern)
+{
+    if (!pattern.startsWith('^')) return 0;
+
+    int depth = 0;
+    for (int i = 1; i < pattern.size(); i++) {
+        QChar c = pattern.at(i);
+
+        if (c == '\\') {
+            if (++i < pattern.size() && pattern.at(i).isDigit()) return 0;
+            continue;
+        }
+
+        // A leading ] is a member, not the end of the class
+        if (c == '[') {
+            if (++i < pattern.size() && pattern.at(i) == '^') i++;
+            if (i < pattern.size() && pattern.at(i) == ']') i++;
+            while (i < pattern.size() && pattern.at(i) != ']') {
+                if (pattern.at(i) == '\\') i++;
+                i++;
+            }
+            continue;
+        }
+
+        if (c == '*' || c == '+' || c == '{' || c == '$') return 0;
+        if (c == '(') {
+            if (i + 1 < pattern.size() && pattern.at(i + 1) == '?') return 0;
+            depth++;
+        }
+        if (c == ')') depth--;
+        if (c == '|' && !depth) return 0;
+    }
+
+    int bound = pattern.size() + 1;
+    return (bound * 4 <= boundedMatchBytes) ? bound : 0;
+}
@@ -0,0 +1,117 @@
+#ifndef IVYSUBSCRIPTIONTABLE_H
+#define IVYSUBSCRIPTIONTABLE_H
+
+#include <QVector>
+#include <QHash>
+#include <QRegExp>
+#include <QString>
+#include <QByteArray>
+
+class IvyClient;
+
+// Remote subscriptions of every peer on the bus
+//
+// A binding is a row across parallel arrays rather than an object of
+// its own, so IvySendMsg walks a few contiguous arrays. Patterns are
+// pooled by text: peers subscribing with the same pattern share one
+// QRegExp, its prefilter literal, flags and match statistics.
+//
+// A peer's identifiers index its rows directly, identifiers from
+// denseIdentifierLimit up (hub relays and catch-all) are hashed.
+class IvySubscriptionTable
+{
+public:
+
+    static const quint16 denseIdentifierLimit = 4096;
+    static const int bytesPerRow = 13; // row arrays and dense index entry
+
+    // Leading bytes of a message which a bounded pattern is matched
+    // against, enough for matchBound characters of UTF-8
+    static const int boundedMatchBytes = 4096;
+
+    typedef enum {
+        RowFree = 0,
+        RowPending = 1, // pattern being compiled
+        RowActive = 2,
+        RowFiltered = 3 // parked by IvySetFilter
+    } RowState;
+
+    typedef enum {
+        PatternReady = 0x01, // compiled, or compiled on first match
+        PatternConflated = 0x02,
+        PatternQuarantined = 0x04
+    } PatternFlag;
+
+    IvySubscriptionTable();
+
+    // Peers own a slot, rows refer to it by index
+    int addPeer(IvyClient *client);
+    void removePeer(int peer);
+    IvyClient *client(int peer) const { return peerClients.at(peer); }
+
+    // Return row of a peer's identifier, -1 if none
+    int find(int peer, quint16 identifier) const;
+    int insert(int peer, quint16 identifier, int pattern, RowState state);
+    void remove(int row);
+    int count() const { return states.count(); }
+    int rowsInUse() const { return states.count() - freeRows.count(); }
+
+    // Return pattern handle, shared with any row already using text
+    int acquirePattern(const QString &text);
+    int findPattern(const QString &text) const { return patternsByText.value(text, -1); }
+    int patternCount() const { return regexps.count(); }
+    int patternsInUse() const { return patternsByText.count(); }
+
+    bool isConflated(int row) const { return (patternFlags.at(patterns.at(row)) & PatternConflated); }
+
+    // Stamp for per message match results, see IvyQt::publish
+    quint32 nextGeneration();
+
+    void clear();
+
+    // Rows
+    QVector<quint16> peers;
+    QVector<quint16> identifiers;
+    QVector<qint32> patterns;
+    QVector<quint8> states;
+
+    // Patterns by handle
+    QVector<QRegExp> regexps;
+    QVector<QByteArray> prefixes; // UTF-8 literal every match starts with, may be empty
+    QVector<qint32> bounds; // characters a match can examine, 0 unbounded
+    QVector<quint32> references;
+    QVector<quint8> patternFlags;
+    QVector<quint32> compileJobs; // in flight, 0 if none
+    QVector<quint64> evaluations;
+    QVector<quint64> hits;
+    QVector<qint64> matchNanoseconds;
+    QVector<qint64> worstMatchNanoseconds;
+
+    // Rows waiting on a pattern compile, may hold removed rows
+    QHash<int, QVector<int> > pendingRows;
+
+    // Result of the current generation, payload index or -1
+    QVector<quint32> generations;
+    QVector<qint32> results;
+
+    static QString anchoredLiteral(const QString &pattern);
+    static int matchBound(const QString &pattern);
+
+private:
+
+    void releasePattern(int pattern);
+
+    QHash<QString, int> patternsByText;
+    QVector<int> freeRows;
+    QVector<int> freePatterns;
+
+    QVector<IvyClient*> peerClients;
+    QVector<int> freePeers;
+    QVector<QVector<qint32> > denseRows; // by peer, then identifier
+    QVector<QHash<quint16, qint32> > sparseRows;
+
+    quint32 generation;
+
+};
+
+#endif // IVYSUBSCRIPTIONTABLE_H
@@ -0,0 +1,148 @@
+#include "ivytokenizer.h"
+
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define IVY_TOKENIZER_SSE2
+#include <emmintrin.h>
+#endif
+
+// AVX2 is compiled per function and only called after a CPU check
+#if defined(IVY_TOKENIZER_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IVY_TOKENIZER_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static inline int lowestBit(unsigned int mask)
+{
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+}
+#elif defined(__GNUC__)
+static inline int lowestBit(unsigned int mask) { return __builtin_ctz(mask); }
+#endif
+
+typedef void (*ScanFunction)(const char *data, int size, QVector<int> *positions);
+
+static inline bool isDelimiter(char c)
+{
+    return (c == '\n' || c == 0x02 || c == 0x03);
+}
+
+// Always built, ivySetTokenizer can select it for comparison
+static void scanScalar(const char *data, int size, QVector<int> *positions)
+{
+    for (int i = 0; i < size; i++)
+        if (isDelimiter(data[i])) positions->append(i);
+}
+
+#ifdef IVY_TOKENIZER_SSE2
+static void scanSse2(const char *data, int size, QVector<int> *positions)
+{
+    const __m128i eol = _mm_set1_epi8('\n');
+    const __m128i stx = _mm_set1_epi8(0x02);
+    const __m128i etx = _mm_set1_epi8(0x03);
+
+    int i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(block, eol),
+                                    _mm_or_si128(_mm_cmpeq_epi8(block, stx), _mm_cmpeq_epi8(block, etx)));
+        unsigned int mask = _mm_movemask_epi8(hits);
+        while (mask) {
+            positions->append(i + lowestBit(mask));
+            mask &= mask - 1;
+        }
+    }
+
+    for (; i < size; i++)
+        if (isDelimiter(data[i])) positions->append(i);
+}
+#endif
+
+#ifdef IVY_TOKENIZER_AVX2
+__attribute__((target("avx2")))
+static void scanAvx2(const char *data, int size, QVector<int> *positions)
+{
+    const __m256i eol = _mm256_set1_epi8('\n');
+    const __m256i stx = _mm256_set1_epi8(0x02);
+    const __m256i etx = _mm256_set1_epi8(0x03);
+
+    int i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(block, eol),
+                                       _mm256_or_si256(_mm256_cmpeq_epi8(block, stx), _mm256_cmpeq_epi8(block, etx)));
+        unsigned int mask = _mm256_movemask_epi8(hits);
+        while (mask) {
+            positions->append(i + lowestBit(mask));
+            mask &= mask - 1;
+        }
+    }
+
+    for (; i < size; i++)
+        if (isDelimiter(data[i])) positions->append(i);
+}
+#endif
+
+static ScanFunction selectScan(const char **name)
+{
+#ifdef IVY_TOKENIZER_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return scanAvx2;
+    }
+#endif
+#ifdef IVY_TOKENIZER_SSE2
+    *name = "sse2";
+    return scanSse2;
+#else
+    *name = "scalar";
+    return scanScalar;
+#endif
+}
+
+static const char *scanName = 0;
+static ScanFunction scanFunction = 0;
+
+void ivyScanDelimiters(const char *data, int size, QVector<int> *positions)
+{
+    if (!scanFunction) scanFunction = selectScan(&scanName);
+    scanFunction(data, size, positions);
+}
+
+const char *ivyTokenizerName()
+{
+    if (!scanFunction) scanFunction = selectScan(&scanName);
+    return scanName;
+}
+
+bool ivySetTokenizer(const char *name)
+{
+    if (!strcmp(name, "scalar")) {
+        scanName = "scalar";
+        scanFunction = scanScalar;
+        return true;
+    }
+#ifdef IVY_TOKENIZER_SSE2
+    if (!strcmp(name, "sse2")) {
+        scanName = "sse2";
+        scanFunction = scanSse2;
+        return true;
+    }
+#endif
+#ifdef IVY_TOKENIZER_AVX2
+    __builtin_cpu_init();
+    if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+        scanName = "avx2";
+        scanFunction = scanAvx2;
+        return true;
+    }
+#endif
+
+    return false;
+}
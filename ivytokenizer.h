@@ -0,0 +1,23 @@
+#ifndef IVYTOKENIZER_H
+#define IVYTOKENIZER_H
+
+#include <QVector>
+
+// Single pass scan for the Ivy frame and field delimiters
+//
+// Appends the offset of every EOL (0x0A), STX (0x02) and ETX (0x03)
+// byte in data to positions, in buffer order, so framing and
+// parameter splitting share one walk over the receive buffer.
+//
+// The scan routine is selected on first use: AVX2 when the CPU
+// supports it, otherwise SSE2 on x86, otherwise a scalar loop.
+void ivyScanDelimiters(const char *data, int size, QVector<int> *positions);
+
+// "avx2", "sse2" or "scalar"
+const char *ivyTokenizerName();
+
+// Force a scan routine by name, for benchmarks. Return false if
+// it is not available in this build or on this CPU
+bool ivySetTokenizer(const char *name);
+
+#endif // IVYTOKENIZER_H
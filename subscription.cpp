@@ -48,13 +48,13 @@ const QString Subscription::pattern()
 
 // Return a pointer to a QList of pointers to QByteArray matches
 // Return NULL if no matches
+// Caller owns the returned list and its entries
 QList<QByteArray*>* Subscription::match(QByteArray *message)
 {
-    QList<QByteArray*> *results = new QList<QByteArray*>;
-
     // Perform RegExp match of message against
     // subscription pattern
     if (regexp.indexIn(QString(*message)) != -1) {
+        QList<QByteArray*> *results = new QList<QByteArray*>;
         for (int i = 0; i < regexp.captureCount(); i++) {
             QByteArray *cap = new QByteArray(regexp.cap(i+1).toUtf8());
             results->append(cap);
@@ -64,6 +64,22 @@ QList<QByteArray*>* Subscription::match(QByteArray *message)
     else return NULL; // not found
 }
 
+SubscriptionCompiler::SubscriptionCompiler(QObject *receiver, quint32 job, const QString &pattern)
+{
+    this->receiver = receiver;
+    this->job = job;
+    this->pattern = pattern;
+}
+
+void SubscriptionCompiler::run()
+{
+    QRegExp regexp(pattern, Qt::CaseSensitive, QRegExp::RegExp);
+    regexp.isValid(); // compiles the engine
+
+    QMetaObject::invokeMethod(receiver, "onSubscriptionCompiled", Qt::QueuedConnection,
+                              Q_ARG(quint32, job), Q_ARG(QRegExp, regexp));
+}
+
 void Subscription::setIdentifier(quint16 identifier)
 {
     this->identifier = identifier;
@@ -3,8 +3,12 @@
 
 #include <QObject>
 #include <QRegExp>
+#include <QRunnable>
+#include <QVector>
 #include <QDebug>
 
+class IvyMessage;
+
 class Subscription : public QObject
 {
     Q_OBJECT
@@ -31,6 +35,10 @@ public:
     QByteArray slotMember;
     QByteArray slotParameters;
 
+    // slot(QVector<IvyMessage*>) receives messages in batches
+    bool isBatched() { return slotParameters == "QVector<IvyMessage*>"; }
+    QVector<IvyMessage*> pendingBatch;
+
 private:
 
     QRegExp regexp;
@@ -38,4 +46,19 @@ private:
 
 };
 
+// Compile a remote pattern on a worker thread
+// The compiled QRegExp shares its engine with copies, so it is
+// handed back to the receiver's thread by value with the job id
+class SubscriptionCompiler : public QRunnable
+{
+public:
+    SubscriptionCompiler(QObject *receiver, quint32 job, const QString &pattern);
+    void run();
+
+private:
+    QObject *receiver;
+    quint32 job;
+    QString pattern;
+};
+
 #endif // SUBSCRIPTION_H